@@ -0,0 +1,409 @@
+#include "ChessboardClient.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+constexpr std::chrono::milliseconds ChessboardClient::DEFAULT_TIMEOUT;
+const size_t ChessboardClient::MAX_BYTES_IN_FLIGHT;
+
+static const char* const CALIBRATION_TYPE_NAMES[] = {
+  "present", "empty", "presentMargin", "emptyMargin"};
+
+static const char BOARD_CHANGED_LINE[] = "Board changed:";
+
+bool parseBitboardRow(const std::string& line, uint8_t row, uint64_t& pieces) {
+  uint8_t col = 0;
+  for (char c : line) {
+    if (c == ' ') {
+      continue;
+    }
+    if ((c != '0' && c != '.') || col >= CHESSBOARD_COLS) {
+      return false;
+    }
+    if (c == '0') {
+      pieces |= 1ULL << (row * CHESSBOARD_COLS + col);
+    }
+    col++;
+  }
+  return col == CHESSBOARD_COLS;
+}
+
+bool parseArrayRow(const std::string& line,
+                   uint16_t values[CHESSBOARD_COLS]) {
+  const char* p = line.c_str();
+  for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+    char* end;
+    const long value = strtol(p, &end, 10);
+    if (end == p || value < 0 || value > 0xFFFF) {
+      return false;
+    }
+    values[col] = value;
+    p = end;
+  }
+  return true;
+}
+
+// Replies to the typed requests end with a header line followed by a board or
+// array, so take the last CHESSBOARD_ROWS lines
+static bool parseArrayReply(const CommandReply& reply, SquareValues& values) {
+  if (reply.lines.size() < CHESSBOARD_ROWS) {
+    return false;
+  }
+  const size_t first = reply.lines.size() - CHESSBOARD_ROWS;
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    if (!parseArrayRow(reply.lines[first + row], values.values[row])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ChessboardClient::~ChessboardClient() {
+  close();
+}
+
+bool ChessboardClient::open(const std::string& path) {
+  close();
+  fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  termios tty;
+  if (tcgetattr(fd, &tty) == 0) {
+    cfmakeraw(&tty);
+    cfsetspeed(&tty, B115200);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tty);
+  }
+  stopEventFd = eventfd(0, EFD_CLOEXEC);
+  changeEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (stopEventFd < 0 || changeEventFd < 0) {
+    fprintf(stderr, "Could not create eventfd: %s\n", strerror(errno));
+    close();
+    return false;
+  }
+  lineBuffer.clear();
+  changeRowsLeft = 0;
+  ready = false;
+  reader = std::thread(&ChessboardClient::readerLoop, this);
+  return true;
+}
+
+void ChessboardClient::close() {
+  if (reader.joinable()) {
+    const uint64_t one = 1;
+    if (write(stopEventFd, &one, sizeof(one)) != sizeof(one)) {
+      perror("eventfd write");
+    }
+    reader.join();
+  }
+  for (int* f : {&fd, &stopEventFd, &changeEventFd}) {
+    if (*f >= 0) {
+      ::close(*f);
+      *f = -1;
+    }
+  }
+  std::lock_guard<std::mutex> lock(repliesMutex);
+  pending.clear();
+}
+
+bool ChessboardClient::waitReady(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(repliesMutex);
+  return repliesChanged.wait_for(lock, timeout, [this] { return ready; });
+}
+
+bool ChessboardClient::writeAll(const std::string& data) {
+  std::lock_guard<std::mutex> lock(writeMutex);
+  size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+uint16_t ChessboardClient::sendCommand(const std::string& command) {
+  uint16_t id;
+  {
+    std::lock_guard<std::mutex> lock(repliesMutex);
+    do {
+      id = nextId++;
+    } while (pending.count(id) != 0);
+    pending[id] = PendingReply();
+  }
+  if (!writeAll("#" + std::to_string(id) + " " + command + "\r\n")) {
+    std::lock_guard<std::mutex> lock(repliesMutex);
+    pending.erase(id);
+  }
+  return id;
+}
+
+bool ChessboardClient::waitReply(uint16_t id, CommandReply& reply,
+                                 std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(repliesMutex);
+  const bool done = repliesChanged.wait_for(lock, timeout, [&] {
+    const auto it = pending.find(id);
+    return it == pending.end() || it->second.done;
+  });
+  const auto it = pending.find(id);
+  if (it == pending.end()) {
+    return false;
+  }
+  if (done) {
+    reply = std::move(it->second.reply);
+  }
+  pending.erase(it);
+  return done;
+}
+
+bool ChessboardClient::command(const std::string& command, CommandReply& reply,
+                               std::chrono::milliseconds timeout) {
+  return waitReply(sendCommand(command), reply, timeout);
+}
+
+bool ChessboardClient::getBoard(uint64_t& pieces) {
+  CommandReply reply;
+  if (!command("print pieces", reply) || reply.status != 0 ||
+      reply.lines.size() < CHESSBOARD_ROWS) {
+    return false;
+  }
+  uint64_t parsed = 0;
+  const size_t first = reply.lines.size() - CHESSBOARD_ROWS;
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    if (!parseBitboardRow(reply.lines[first + row], row, parsed)) {
+      return false;
+    }
+  }
+  pieces = parsed;
+  return true;
+}
+
+bool ChessboardClient::getRawFrame(SquareValues& values) {
+  CommandReply reply;
+  return command("print raw", reply) && reply.status == 0 &&
+         parseArrayReply(reply, values);
+}
+
+bool ChessboardClient::getCalibration(CalibrationType type,
+                                      SquareValues& values) {
+  CommandReply reply;
+  return command(std::string("calibrate ") +
+                   CALIBRATION_TYPE_NAMES[static_cast<int>(type)] +
+                   " get global",
+                 reply) &&
+         reply.status == 0 && parseArrayReply(reply, values);
+}
+
+bool ChessboardClient::setCalibration(CalibrationType type, uint8_t row,
+                                      uint8_t col, uint16_t value) {
+  CommandReply reply;
+  return command(std::string("calibrate ") +
+                   CALIBRATION_TYPE_NAMES[static_cast<int>(type)] + " set " +
+                   std::to_string(row) + "," + std::to_string(col) + " " +
+                   std::to_string(value),
+                 reply) &&
+         reply.status == 0;
+}
+
+bool ChessboardClient::setCalibration(CalibrationType type,
+                                      const SquareValues& values) {
+  // Sends the next command as replies free up room in the firmware's serial
+  // receive buffer
+  std::deque<std::pair<uint16_t, size_t>> inFlight; // ID and request size
+  size_t bytesInFlight = 0;
+  bool ok = true;
+  const auto waitOldest = [&] {
+    CommandReply reply;
+    ok = waitReply(inFlight.front().first, reply) && reply.status == 0 && ok;
+    bytesInFlight -= inFlight.front().second;
+    inFlight.pop_front();
+  };
+  for (uint8_t square = 0; square < CHESSBOARD_ROWS * CHESSBOARD_COLS && ok;
+       square++) {
+    const uint8_t row = square / CHESSBOARD_COLS;
+    const uint8_t col = square % CHESSBOARD_COLS;
+    const std::string command =
+      std::string("calibrate ") +
+      CALIBRATION_TYPE_NAMES[static_cast<int>(type)] + " set " +
+      std::to_string(row) + "," + std::to_string(col) + " " +
+      std::to_string(values.values[row][col]);
+    const size_t size = requestSize(command);
+    while (!inFlight.empty() && bytesInFlight + size > MAX_BYTES_IN_FLIGHT) {
+      waitOldest();
+    }
+    inFlight.emplace_back(sendCommand(command), size);
+    bytesInFlight += size;
+  }
+  while (!inFlight.empty()) {
+    waitOldest();
+  }
+  return ok;
+}
+
+bool ChessboardClient::getSetting(const std::string& key, int32_t& value) {
+  CommandReply reply;
+  if (!command("settings get " + key, reply) || reply.status != 0 ||
+      reply.lines.empty()) {
+    return false;
+  }
+  char* end;
+  const char* last = reply.lines.back().c_str();
+  const long parsed = strtol(last, &end, 10);
+  if (end == last) {
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+bool ChessboardClient::setSetting(const std::string& key, int32_t value) {
+  CommandReply reply;
+  return command("settings set " + key + " " + std::to_string(value), reply) &&
+         reply.status == 0;
+}
+
+bool ChessboardClient::subscribeChanges(bool subscribe) {
+  return setSetting("PRINT_ON_BOARD_CHANGE", subscribe ? 1 : 0);
+}
+
+bool ChessboardClient::pollChange(BoardChange& change) {
+  return changes.pop(change);
+}
+
+bool ChessboardClient::waitChange(BoardChange& change,
+                                  std::chrono::milliseconds timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    if (changes.pop(change)) {
+      return true;
+    }
+    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+    if (left.count() < 0) {
+      return false;
+    }
+    pollfd pfd = {changeEventFd, POLLIN, 0};
+    if (poll(&pfd, 1, left.count() + 1) > 0) {
+      // Clear the counter, anything pushed after this wakes us up again
+      uint64_t count;
+      if (read(changeEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return false;
+      }
+    }
+  }
+}
+
+void ChessboardClient::readerLoop() {
+  char buffer[4096];
+  pollfd fds[2] = {{fd, POLLIN, 0}, {stopEventFd, POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    if (fds[0].revents & (POLLERR | POLLNVAL)) {
+      break;
+    }
+    if (fds[0].revents & POLLHUP && !(fds[0].revents & POLLIN)) {
+      // The other end of a pseudo-terminal isn't open (yet), don't spin
+      usleep(10000);
+      continue;
+    }
+    const ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EIO) {
+      break;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      const char c = buffer[i];
+      if (c == '\n') {
+        handleLine(lineBuffer);
+        lineBuffer.clear();
+      } else if (c != '\r') {
+        lineBuffer += c;
+      }
+    }
+  }
+  // Wake up anyone still waiting, their replies will never come
+  std::lock_guard<std::mutex> lock(repliesMutex);
+  pending.clear();
+  repliesChanged.notify_all();
+}
+
+void ChessboardClient::handleLine(const std::string& line) {
+  if (changeRowsLeft > 0) {
+    const uint8_t row = CHESSBOARD_ROWS - changeRowsLeft;
+    if (!parseBitboardRow(line, row, changePieces)) {
+      changeRowsLeft = 0;
+    } else if (--changeRowsLeft == 0) {
+      const BoardChange change = {changePieces,
+                                  std::chrono::steady_clock::now()};
+      if (changes.push(change)) {
+        const uint64_t one = 1;
+        if (write(changeEventFd, &one, sizeof(one)) != sizeof(one)) {
+          perror("eventfd write");
+        }
+      } else {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      return;
+    } else {
+      return;
+    }
+  }
+  if (line == BOARD_CHANGED_LINE) {
+    changeRowsLeft = CHESSBOARD_ROWS;
+    changePieces = 0;
+    return;
+  }
+  if (line == "Ready") {
+    std::lock_guard<std::mutex> lock(repliesMutex);
+    ready = true;
+    repliesChanged.notify_all();
+    return;
+  }
+  if (line.empty() || line[0] != '#') {
+    return;
+  }
+
+  // "#id text" or "#id END status"
+  char* end;
+  const unsigned long id = strtoul(line.c_str() + 1, &end, 10);
+  if (end == line.c_str() + 1 || *end != ' ' || id > 0xFFFF) {
+    return;
+  }
+  const char* text = end + 1;
+  std::lock_guard<std::mutex> lock(repliesMutex);
+  const auto it = pending.find(id);
+  if (it == pending.end()) {
+    return;
+  }
+  if (strncmp(text, "END ", 4) == 0) {
+    it->second.reply.status = atoi(text + 4);
+    it->second.done = true;
+    repliesChanged.notify_all();
+  } else {
+    it->second.reply.lines.emplace_back(text);
+  }
+}
@@ -0,0 +1,147 @@
+#ifndef CHESSBOARD_CLIENT_H
+#define CHESSBOARD_CLIENT_H
+
+#include "Detection.h"
+#include "SpscQueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Client for the firmware's serial protocol, over a serial port or a
+// pseudo-terminal. (see SimulatedBoard.h)
+//
+// Every request is sent as a tagged command (`#id command`) so replies can be
+// matched to requests even when several are in flight. A reader thread splits
+// the incoming lines into replies, which wake up the waiting caller, and
+// `Board changed:` notifications, which go through a lock-free queue to a
+// single consumer thread.
+//
+// Binary output (`trace` and `stream`) isn't understood, don't start it through
+// this client.
+
+struct SquareValues {
+  uint16_t values[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+};
+
+enum class CalibrationType { Present, Empty, PresentMargin, EmptyMargin };
+
+struct CommandReply {
+  uint8_t status; // COMMAND_STATUS_* in the firmware, 0 is OK
+  std::vector<std::string> lines;
+};
+
+struct BoardChange {
+  uint64_t pieces;
+  std::chrono::steady_clock::time_point receivedTime;
+};
+
+class ChessboardClient {
+  public:
+    ChessboardClient() = default;
+    ~ChessboardClient();
+    ChessboardClient(const ChessboardClient&) = delete;
+    ChessboardClient& operator=(const ChessboardClient&) = delete;
+
+    // Opens a serial port (set to 115200 baud, raw) or pseudo-terminal and
+    // starts the reader thread. Opening a Nano's serial port resets it, use
+    // waitReady() before sending commands.
+    bool open(const std::string& path);
+    void close();
+    bool isOpen() const {
+      return fd >= 0;
+    }
+
+    // Waits for the `Ready` line the firmware prints at the end of setup()
+    bool waitReady(std::chrono::milliseconds timeout);
+
+    // Sends a command without waiting, returns its request ID for waitReply()
+    uint16_t sendCommand(const std::string& command);
+    bool waitReply(uint16_t id, CommandReply& reply,
+                   std::chrono::milliseconds timeout = DEFAULT_TIMEOUT);
+    // Sends a command and waits for its reply
+    bool command(const std::string& command, CommandReply& reply,
+                 std::chrono::milliseconds timeout = DEFAULT_TIMEOUT);
+
+    // Typed requests, false on a timeout, an error status or an unexpected
+    // reply.
+    bool getBoard(uint64_t& pieces);
+    bool getRawFrame(SquareValues& values);
+    bool getCalibration(CalibrationType type, SquareValues& values);
+    bool setCalibration(CalibrationType type, uint8_t row, uint8_t col,
+                        uint16_t value);
+    // Sets every square, pipelining the commands within MAX_BYTES_IN_FLIGHT
+    bool setCalibration(CalibrationType type, const SquareValues& values);
+    bool getSetting(const std::string& key, int32_t& value);
+    bool setSetting(const std::string& key, int32_t value);
+
+    // Turns the PRINT_ON_BOARD_CHANGE setting on or off
+    bool subscribeChanges(bool subscribe);
+    // Only call these from one thread at a time
+    bool pollChange(BoardChange& change);
+    bool waitChange(BoardChange& change, std::chrono::milliseconds timeout);
+    // Becomes readable when changes are queued, for use with poll()
+    int changeFd() const {
+      return changeEventFd;
+    }
+    // Changes lost because the consumer fell behind
+    uint64_t droppedChanges() const {
+      return dropped.load(std::memory_order_relaxed);
+    }
+
+    static constexpr std::chrono::milliseconds DEFAULT_TIMEOUT{2000};
+
+    // The firmware only reads the next command after writing the reply to the
+    // previous one, and drops whatever doesn't fit in its serial receive buffer
+    // (SERIAL_RX_BUFFER_SIZE, 128, holding 127 bytes) meanwhile. Pipelined
+    // commands must keep fewer bytes than that unanswered.
+    static const size_t MAX_BYTES_IN_FLIGHT = 127;
+    // Bytes a request for command takes on the wire, with the longest tag
+    static size_t requestSize(const std::string& command) {
+      return command.size() + sizeof("#65535 \r\n") - 1;
+    }
+
+  private:
+    struct PendingReply {
+      bool done = false;
+      CommandReply reply;
+    };
+
+    void readerLoop();
+    void handleLine(const std::string& line);
+    bool writeAll(const std::string& data);
+
+    int fd = -1;
+    int stopEventFd = -1;
+    int changeEventFd = -1;
+    std::thread reader;
+
+    std::mutex writeMutex;
+    std::mutex repliesMutex;
+    std::condition_variable repliesChanged;
+    std::unordered_map<uint16_t, PendingReply> pending;
+    uint16_t nextId = 0;
+    bool ready = false;
+
+    // Only touched by the reader thread
+    std::string lineBuffer;
+    uint8_t changeRowsLeft = 0;
+    uint64_t changePieces = 0;
+
+    SpscQueue<BoardChange, 256> changes;
+    std::atomic<uint64_t> dropped{0};
+};
+
+// Parses a board printed by printBitboard() in the firmware, one row per line
+bool parseBitboardRow(const std::string& line, uint8_t row, uint64_t& pieces);
+// Parses a row printed by printMemoryArray() in the firmware
+bool parseArrayRow(const std::string& line,
+                   uint16_t values[CHESSBOARD_COLS]);
+
+#endif
@@ -0,0 +1,1212 @@
+#include "SimulatedBoard.h"
+
+#include "Telemetry.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+// serialCommandsBuffer in the firmware, including the terminator
+static const size_t COMMAND_BUFFER_SIZE = 64;
+
+static const uint8_t COMMAND_STATUS_OK = 0;
+static const uint8_t COMMAND_STATUS_ERROR = 1;
+static const uint8_t COMMAND_STATUS_UNRECOGNIZED = 2;
+
+static const uint8_t SQUARES = CHESSBOARD_ROWS * CHESSBOARD_COLS;
+// A marker, the present values in 10 bits and the margins in a byte
+static const uint16_t PROFILE_SIZE_IN_EEPROM =
+  1 + SQUARES + SQUARES / 4 + SQUARES;
+
+// How the firmware's expanders are wired, for `health`
+static const uint8_t EXPANDER_ANALOG_PINS[CHESSBOARD_ROWS] = {7, 6, 5, 4,
+                                                              3, 2, 1, 0};
+static const uint8_t EXPANDER_COLS_TO_BITS[CHESSBOARD_COLS] = {2, 1, 0, 3,
+                                                               5, 7, 6, 4};
+// An expander is suspect when at least this many of its channels are
+static const uint8_t EXPANDER_SUSPECT_SQUARES = CHESSBOARD_COLS / 2;
+
+static const uint8_t TASK_SERIAL = 0;
+static const uint8_t TASK_DETECT = 1;
+
+// Like printing a float on the Arduino
+static std::string formatFloat(double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.2f", value);
+  return buffer;
+}
+
+SimulatedBoard::SimulatedBoard(uint32_t framePeriodUs, uint32_t baudRate)
+    : framePeriodUs(framePeriodUs),
+      byteTime(baudRate == 0 ? 0 : 10000000000ULL / baudRate) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      presentValues[row][col] = PRESENT_VALUE;
+      emptyValues[row][col] = EMPTY_VALUE;
+      presentMargins[row][col] = 40;
+      emptyMargins[row][col] = 40;
+    }
+  }
+  memcpy(eepromPresentValues, presentValues, sizeof(Array));
+  memcpy(eepromEmptyValues, emptyValues, sizeof(Array));
+  memcpy(eepromPresentMargins, presentMargins, sizeof(Array));
+  memcpy(eepromEmptyMargins, emptyMargins, sizeof(Array));
+}
+
+SimulatedBoard::~SimulatedBoard() {
+  stop();
+}
+
+bool SimulatedBoard::start() {
+  masterFd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (masterFd < 0 || grantpt(masterFd) != 0 || unlockpt(masterFd) != 0) {
+    fprintf(stderr, "Could not create pseudo-terminal: %s\n", strerror(errno));
+    stop();
+    return false;
+  }
+  slavePath = ptsname(masterFd);
+  // Keep the slave open so the master doesn't hang up between clients, and
+  // make it raw so nothing is echoed back before a client configures it
+  slaveFd = open(slavePath.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (slaveFd < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", slavePath.c_str(),
+            strerror(errno));
+    stop();
+    return false;
+  }
+  termios tty;
+  tcgetattr(slaveFd, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(slaveFd, TCSANOW, &tty);
+  // Like a serial port, output is lost when nobody reads it
+  fcntl(masterFd, F_SETFL, fcntl(masterFd, F_GETFL) | O_NONBLOCK);
+
+  running = true;
+  thread = std::thread(&SimulatedBoard::run, this);
+  return true;
+}
+
+void SimulatedBoard::stop() {
+  running = false;
+  if (thread.joinable()) {
+    thread.join();
+  }
+  for (int* fd : {&masterFd, &slaveFd}) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+uint64_t SimulatedBoard::micros() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+           std::chrono::steady_clock::now() - startTime)
+    .count();
+}
+
+void SimulatedBoard::run() {
+  startTime = std::chrono::steady_clock::now();
+  println("Chessboard controller starting");
+  println("Ready");
+  flush();
+
+  using Clock = std::chrono::steady_clock;
+  const auto framePeriod = std::chrono::microseconds(framePeriodUs);
+  auto nextFrame = Clock::now() + framePeriod;
+  while (running) {
+    receive();
+    transmit();
+    // Like Serial.write(), the firmware waits while its transmit buffer is full
+    const bool stalled = transmitBuffer.size() > TX_BUFFER_SIZE;
+    const auto now = Clock::now();
+    const uint64_t passStart = micros();
+    passes++;
+    if (!stalled && now >= nextFrame) {
+      const uint64_t frameReadyTime =
+        std::chrono::duration_cast<std::chrono::microseconds>(nextFrame -
+                                                              startTime)
+          .count();
+      runTask(tasks[TASK_DETECT], frameReadyTime, passStart,
+              &SimulatedBoard::scanFrame);
+      flush();
+      nextFrame += framePeriod;
+      if (nextFrame < now) {
+        nextFrame = now + framePeriod;
+      }
+      continue;
+    }
+    if (!stalled && !receiveBuffer.empty()) {
+      runTask(tasks[TASK_SERIAL], inputReadyTime, passStart,
+              &SimulatedBoard::serialTask);
+      flush();
+      continue;
+    }
+    idlePasses++;
+    // Sleep until the next frame, byte in or out or input from the client,
+    // waking up at least every 10 ms to notice stop(). Bytes move at most
+    // every millisecond, like the frames of a USB serial adapter.
+    auto wake = std::min(nextFrame, now + std::chrono::milliseconds(10));
+    const auto nextBatch = now + std::chrono::milliseconds(1);
+    if (!incoming.empty()) {
+      wake = std::min(wake, std::max(nextArrivalTime, nextBatch));
+    }
+    if (!transmitBuffer.empty()) {
+      wake = std::min(wake, std::max(nextTransmitTime, nextBatch));
+    }
+    const auto wait = std::max(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(wake - now),
+      std::chrono::nanoseconds(0));
+    const timespec timeout = {static_cast<time_t>(wait.count() / 1000000000),
+                              static_cast<long>(wait.count() % 1000000000)};
+    pollfd pfd = {masterFd, POLLIN, 0};
+    ppoll(&pfd, 1, &timeout, nullptr);
+  }
+}
+
+// Runs a task and keeps its statistics like schedulerRun()
+void SimulatedBoard::runTask(TaskStats& task, uint64_t readyTime,
+                             uint64_t passStart,
+                             void (SimulatedBoard::*function)()) {
+  const uint64_t taskStart = micros();
+  if (taskStart > readyTime + task.deadlineUs) {
+    task.deadlineMisses++;
+  }
+  (this->*function)();
+  const uint64_t runtime = micros() - taskStart;
+  task.runs++;
+  task.totalRuntimeUs += runtime;
+  task.maxRuntimeUs = std::max<uint64_t>(task.maxRuntimeUs, runtime);
+  if (runtime > task.budgetUs) {
+    task.budgetOverruns++;
+  }
+  overheadUs += micros() - passStart - runtime;
+}
+
+// Like SerialCommands, reads up to the end of a command and runs it
+void SimulatedBoard::serialTask() {
+  const size_t end = receiveBuffer.find('\n');
+  const size_t length = end == std::string::npos ? receiveBuffer.size() : end;
+  for (size_t i = 0; i < length; i++) {
+    if (receiveBuffer[i] != '\r') {
+      line += receiveBuffer[i];
+    }
+  }
+  if (end == std::string::npos) {
+    receiveBuffer.clear();
+    return;
+  }
+  receiveBuffer.erase(0, end + 1);
+  handleLine(line);
+  line.clear();
+  // The next command has been waiting since now at the latest
+  inputReadyTime = micros();
+}
+
+// Moves input from the pseudo-terminal onto the wire, and what has arrived by
+// now into the receive buffer
+void SimulatedBoard::receive() {
+  const auto now = std::chrono::steady_clock::now();
+  char buffer[256];
+  ssize_t n;
+  while ((n = read(masterFd, buffer, sizeof(buffer))) > 0) {
+    if (incoming.empty()) {
+      nextArrivalTime = now + byteTime;
+    }
+    incoming.append(buffer, n);
+  }
+  const bool wasEmpty = receiveBuffer.empty();
+  size_t arrived = 0;
+  while (arrived < incoming.size() && nextArrivalTime <= now) {
+    // The ring buffer holds one byte less than its size
+    if (byteTime.count() == 0 || receiveBuffer.size() < RX_BUFFER_SIZE - 1) {
+      receiveBuffer += incoming[arrived];
+    } else {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    arrived++;
+    nextArrivalTime += byteTime;
+  }
+  incoming.erase(0, arrived);
+  if (wasEmpty && !receiveBuffer.empty()) {
+    inputReadyTime = micros();
+  }
+}
+
+// Writes what has gone out by now to the pseudo-terminal
+void SimulatedBoard::transmit() {
+  const auto now = std::chrono::steady_clock::now();
+  size_t sent = 0;
+  while (sent < transmitBuffer.size() && nextTransmitTime <= now) {
+    sent++;
+    nextTransmitTime += byteTime;
+  }
+  size_t written = 0;
+  while (written < sent) {
+    const ssize_t n =
+      write(masterFd, transmitBuffer.data() + written, sent - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      // Give a slow reader a moment before dropping the rest
+      pollfd pfd = {masterFd, POLLOUT, 0};
+      if (poll(&pfd, 1, 100) > 0) {
+        continue;
+      }
+    }
+    if (n <= 0) {
+      break;
+    }
+    written += n;
+  }
+  transmitBuffer.erase(0, sent);
+}
+
+// Like linearHallsRead()
+void SimulatedBoard::readSensors() {
+  const uint64_t target = targetPieces.load(std::memory_order_relaxed);
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      const bool present = target & (1ULL << (row * CHESSBOARD_COLS + col));
+      // Small LCG so runs are repeatable
+      noiseState = noiseState * 1103515245 + 12345;
+      const int16_t noise =
+        static_cast<int16_t>((noiseState >> 16) % (2 * NOISE + 1)) - NOISE;
+      values[row][col] = (present ? PRESENT_VALUE : EMPTY_VALUE) + noise;
+    }
+  }
+}
+
+// Like the firmware's scan and detect tasks for one frame
+void SimulatedBoard::scanFrame() {
+  memcpy(previousValues, values, sizeof(Array));
+  readSensors();
+  frames.fetch_add(1, std::memory_order_relaxed);
+  if (firstFrame) {
+    memcpy(previousValues, values, sizeof(Array));
+    firstFrame = false;
+  }
+  if (traceHeaderPending) {
+    traceWriteHeader();
+    traceHeaderPending = false;
+  }
+  unhealthySquares =
+    healthUpdate(values, previousValues, presentValues, emptyValues,
+                 presentMargins, emptyMargins, health);
+  if (tracing) {
+    traceWriteFrame();
+  }
+  if (streaming) {
+    streamWriteFrame();
+  }
+
+  if (!likelihoodsValid) {
+    detectionUpdateLikelihoods(presentMargins, emptyMargins, likelihoods);
+    likelihoodsValid = true;
+  }
+  previousPieces = pieces;
+  pieces = detectionUpdatePieces(
+    values, presentValues, emptyValues, presentMargins, emptyMargins,
+    likelihoods, crosstalkCompensation ? crosstalk : nullptr, previousPieces,
+    detectionMethod, confidence);
+  if (maskUnhealthySquares) {
+    pieces = (pieces & ~unhealthySquares) | (previousPieces & unhealthySquares);
+  }
+  if (printOnBoardChange && pieces != previousPieces && !tracing) {
+    println("Board changed:");
+    printBitboard(pieces);
+  }
+}
+
+void SimulatedBoard::writeBytes(const void* data, size_t size) {
+  output.append(static_cast<const char*>(data), size);
+}
+
+// See Trace.h for the format, the host is little-endian like the AVR
+void SimulatedBoard::traceWriteHeader() {
+  const uint8_t info[] = {TRACE_VERSION, CHESSBOARD_ROWS, CHESSBOARD_COLS,
+                          detectionMethod};
+  writeBytes(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  writeBytes(info, sizeof(info));
+  writeBytes(presentValues, sizeof(Array));
+  writeBytes(emptyValues, sizeof(Array));
+  writeBytes(presentMargins, sizeof(Array));
+  writeBytes(emptyMargins, sizeof(Array));
+  writeBytes(&crosstalkCompensation, 1);
+  writeBytes(crosstalk, sizeof(crosstalk));
+  writeBytes(&maskUnhealthySquares, 1);
+  writeBytes(&pieces, sizeof(pieces));
+  writeBytes(previousValues, sizeof(Array));
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      writeBytes(&health[row][col].unchangedFrames, 1);
+    }
+  }
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      writeBytes(&health[row][col].noise, sizeof(health[row][col].noise));
+    }
+  }
+}
+
+void SimulatedBoard::traceWriteFrame() {
+  const uint32_t timestamp = millis();
+  writeBytes(&TRACE_FRAME_TAG, 1);
+  writeBytes(&timestamp, sizeof(timestamp));
+  writeBytes(values, sizeof(Array));
+}
+
+// See Telemetry.h for the format
+void SimulatedBoard::streamWriteFrame() {
+  uint8_t frame[TELEMETRY_MAX_FRAME_SIZE];
+  const bool keyframe = streamFrames % streamKeyframeInterval == 0;
+  const uint8_t length = telemetryEncodeFrame(values, previousValues, keyframe,
+                                              streamSequence++, frame);
+  writeBytes(frame, length);
+  streamFrames++;
+  streamBytes += length;
+}
+
+void SimulatedBoard::println(const std::string& line) {
+  output += linePrefix;
+  output += line;
+  output += "\r\n";
+}
+
+void SimulatedBoard::printError(const std::string& message) {
+  commandStatus = COMMAND_STATUS_ERROR;
+  println(message);
+}
+
+void SimulatedBoard::flush() {
+  if (transmitBuffer.empty()) {
+    nextTransmitTime = std::chrono::steady_clock::now() + byteTime;
+  }
+  transmitBuffer += output;
+  output.clear();
+  transmit();
+}
+
+void SimulatedBoard::printArray(const Array array, uint8_t thisRowOnly,
+                                uint8_t thisColOnly) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    std::string line;
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      if ((thisRowOnly != 255 && row != thisRowOnly) ||
+          (thisColOnly != 255 && col != thisColOnly)) {
+        line += "-    ";
+        continue;
+      }
+      char cell[8];
+      snprintf(cell, sizeof(cell), "%-5u", array[row][col]);
+      line += cell;
+    }
+    println(line);
+  }
+}
+
+void SimulatedBoard::printBitboard(uint64_t bitboard) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    std::string line;
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      const bool isPresent = bitboard & (1ULL << (row * CHESSBOARD_COLS + col));
+      line += isPresent ? "0 " : ". ";
+    }
+    println(line);
+  }
+}
+
+SimulatedBoard::Array* SimulatedBoard::calibrationArray(const char* type,
+                                                        bool eeprom) {
+  if (strcmp(type, "present") == 0) {
+    return eeprom ? &eepromPresentValues : &presentValues;
+  } else if (strcmp(type, "empty") == 0) {
+    return eeprom ? &eepromEmptyValues : &emptyValues;
+  } else if (strcmp(type, "presentMargin") == 0) {
+    return eeprom ? &eepromPresentMargins : &presentMargins;
+  } else if (strcmp(type, "emptyMargin") == 0) {
+    return eeprom ? &eepromEmptyMargins : &emptyMargins;
+  }
+  return nullptr;
+}
+
+void SimulatedBoard::handleLine(const std::string& line) {
+  if (line.size() >= COMMAND_BUFFER_SIZE) {
+    println("Command too long, limit is " +
+            std::to_string(COMMAND_BUFFER_SIZE - 1) + " characters");
+    return;
+  }
+  char buffer[COMMAND_BUFFER_SIZE];
+  strcpy(buffer, line.c_str());
+  char* args = buffer;
+  const char* name = strsep(&args, " ");
+  if (name[0] == '\0') {
+    return;
+  }
+  if (name[0] != '#') {
+    runCommand(name, args);
+    return;
+  }
+
+  char* end;
+  const unsigned long id = strtoul(name + 1, &end, 10);
+  if (!isdigit(static_cast<unsigned char>(name[1])) || *end != '\0' ||
+      id > UINT16_MAX) {
+    println(std::string(name) + " Invalid request ID");
+    println(std::string(name) + " END " +
+            std::to_string(COMMAND_STATUS_ERROR));
+    return;
+  }
+  linePrefix = "#" + std::to_string(id) + " ";
+  commandStatus = COMMAND_STATUS_OK;
+  name = args == nullptr ? nullptr : strsep(&args, " ");
+  if (name == nullptr || name[0] == '\0') {
+    printError("Missing command");
+  } else {
+    runCommand(name, args);
+  }
+  linePrefix.clear();
+  println("#" + std::to_string(id) + " END " + std::to_string(commandStatus));
+}
+
+void SimulatedBoard::runCommand(const char* name, char* args) {
+  if (strcmp(name, "print") == 0) {
+    cmdPrint(args);
+  } else if (strcmp(name, "calibrate") == 0) {
+    cmdCalibrate(args);
+  } else if (strcmp(name, "calibrationSaveToEEPROM") == 0) {
+    cmdCalibrationEEPROM(args, true);
+  } else if (strcmp(name, "calibrationLoadFromEEPROM") == 0) {
+    cmdCalibrationEEPROM(args, false);
+  } else if (strcmp(name, "profile") == 0) {
+    cmdProfile(args);
+  } else if (strcmp(name, "settings") == 0) {
+    cmdSettings(args);
+  } else if (strcmp(name, "trace") == 0) {
+    cmdTrace(args);
+  } else if (strcmp(name, "crosstalk") == 0) {
+    cmdCrosstalk(args);
+  } else if (strcmp(name, "stream") == 0) {
+    cmdStream(args);
+  } else if (strcmp(name, "health") == 0) {
+    cmdHealth(args);
+  } else if (strcmp(name, "tasks") == 0) {
+    cmdTasks(args);
+  } else {
+    println(std::string("Unrecognized command: ") + name);
+    commandStatus = COMMAND_STATUS_UNRECOGNIZED;
+  }
+}
+
+// "present calibration value" and so on, as the firmware describes them
+static std::string calibrationDescription(const char* type) {
+  if (strcmp(type, "present") == 0) {
+    return "present calibration value";
+  } else if (strcmp(type, "empty") == 0) {
+    return "empty calibration value";
+  } else if (strcmp(type, "presentMargin") == 0) {
+    return "present calibration margin value";
+  }
+  return "empty calibration margin value";
+}
+
+// Like SerialCommands::Next(), skipping repeated delimiters
+static char* nextArg(char*& args) {
+  char* arg;
+  do {
+    if (args == nullptr) {
+      return nullptr;
+    }
+    arg = strsep(&args, " ");
+  } while (arg[0] == '\0');
+  return arg;
+}
+
+void SimulatedBoard::cmdPrint(char* args) {
+  const char* type = nextArg(args);
+  const bool printAll = type != nullptr && strcmp(type, "all") == 0;
+  const auto is = [&](const char* name) {
+    return printAll || (type != nullptr && strcmp(type, name) == 0);
+  };
+  bool printedSomething = false;
+  if (type == nullptr || is("pieces")) {
+    println("Printing pieces");
+    printBitboard(pieces);
+    printedSomething = true;
+  }
+  if (is("piecesDebug")) {
+    println("Printing pieces with debugging");
+    println("<-------[---empty---]-------[---present---]------->");
+    println("    -         .         ?          0          X");
+    uint8_t occupiedRows[CHESSBOARD_ROWS];
+    detectionBitboardRows(previousPieces, occupiedRows);
+    for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+      std::string line;
+      for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+        const uint16_t value =
+          crosstalkCompensation
+            ? detectionCompensatedValue(values, emptyValues, crosstalk,
+                                        occupiedRows, row, col)
+            : values[row][col];
+        line += detectionDebugSymbol(
+          value, presentValues[row][col], emptyValues[row][col],
+          presentMargins[row][col], emptyMargins[row][col]);
+      }
+      println(line);
+    }
+    printedSomething = true;
+  }
+  if (is("confidence")) {
+    println("Printing piece confidence values");
+    Array widened;
+    for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+      for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+        widened[row][col] = confidence[row][col];
+      }
+    }
+    printArray(widened);
+    printedSomething = true;
+  }
+  if (is("raw")) {
+    println("Printing raw values");
+    printArray(values);
+    printedSomething = true;
+  }
+  static const struct {
+    const char* type;
+    const char* calibration;
+    const char* description;
+    bool eeprom;
+  } ARRAYS[] = {
+    {"presentCalibration", "present", "present calibration values", false},
+    {"presentCalibrationEEPROM", "present",
+     "present calibration values in EEPROM", true},
+    {"emptyCalibration", "empty", "empty calibration values", false},
+    {"emptyCalibrationEEPROM", "empty", "empty calibration values in EEPROM",
+     true},
+    {"presentCalibrationMargin", "presentMargin",
+     "present calibration margin values", false},
+    {"presentCalibrationMarginEEPROM", "presentMargin",
+     "present calibration margin values in EEPROM", true},
+    {"emptyCalibrationMargin", "emptyMargin", "empty calibration margin values",
+     false},
+    {"emptyCalibrationMarginEEPROM", "emptyMargin",
+     "empty calibration margin values in EEPROM", true},
+  };
+  for (const auto& array : ARRAYS) {
+    if (is(array.type)) {
+      println(std::string("Printing ") + array.description);
+      printArray(*calibrationArray(array.calibration, array.eeprom));
+      printedSomething = true;
+    }
+  }
+  if (!printedSomething) {
+    printError(std::string("Invalid print type: ") + (type ? type : ""));
+  }
+}
+
+void SimulatedBoard::cmdCalibrate(char* args) {
+  const char* type = nextArg(args);
+  if (type == nullptr) {
+    printError("Missing calibration type");
+    return;
+  }
+  Array* array = calibrationArray(type, false);
+  if (array == nullptr) {
+    printError(std::string("Invalid calibration type: ") + type);
+    return;
+  }
+  const char* action = nextArg(args);
+  if (action == nullptr) {
+    printError("Missing action");
+    return;
+  }
+  const bool set = strcmp(action, "set") == 0;
+  if (!set && strcmp(action, "get") != 0) {
+    printError(std::string("Invalid action: ") + action);
+    return;
+  }
+  char* position = nextArg(args);
+  if (position == nullptr) {
+    printError("Missing position");
+    return;
+  }
+  uint8_t row = 255;
+  uint8_t col = 255;
+  if (strcmp(position, "global") != 0) {
+    const char* rowStr = strsep(&position, ",");
+    const char* colStr = position;
+    if (colStr == nullptr) {
+      printError("Invalid position");
+      return;
+    }
+    row = atoi(rowStr);
+    col = atoi(colStr);
+    if ((row >= CHESSBOARD_ROWS && row != 255) ||
+        (col >= CHESSBOARD_COLS && col != 255)) {
+      printError("Invalid position");
+      return;
+    }
+  }
+  const char* valueStr = nextArg(args);
+  int16_t value = -1;
+  if (valueStr != nullptr) {
+    value = atoi(valueStr);
+    value = value < 0 ? 0 : value > 1023 ? 1023 : value;
+  }
+
+  const std::string description = calibrationDescription(type);
+  std::string target;
+  if (row == 255 && col == 255) {
+    target = "s";
+  } else if (row == 255) {
+    target = "s for col " + std::to_string(col);
+  } else if (col == 255) {
+    target = "s for row " + std::to_string(row);
+  } else {
+    target = " for row " + std::to_string(row) + " col " + std::to_string(col);
+  }
+  if (!set) {
+    println("Printing " + description + target);
+    if (row != 255 && col != 255) {
+      println(std::to_string((*array)[row][col]));
+    } else {
+      printArray(*array, row, col);
+    }
+    return;
+  }
+  println("Setting " + description + target + " to " +
+          (value == -1 ? "the linear hall's current reading"
+                       : std::to_string(value)));
+  for (uint8_t r = 0; r < CHESSBOARD_ROWS; r++) {
+    for (uint8_t c = 0; c < CHESSBOARD_COLS; c++) {
+      if ((row == 255 || r == row) && (col == 255 || c == col)) {
+        (*array)[r][c] = value == -1 ? values[r][c] : value;
+      }
+    }
+  }
+  likelihoodsValid = false;
+}
+
+void SimulatedBoard::cmdCalibrationEEPROM(char* args, bool save) {
+  const char* type = nextArg(args);
+  if (type == nullptr) {
+    printError("Missing calibration type");
+    return;
+  }
+  static const char* const TYPES[] = {"present", "empty", "presentMargin",
+                                      "emptyMargin"};
+  const bool all = strcmp(type, "all") == 0;
+  // Like the firmware, the present calibration in EEPROM is profile 0's
+  if (activeProfile != 0 &&
+      (all || strcmp(type, "present") == 0 ||
+       strcmp(type, "presentMargin") == 0)) {
+    printError("Use `profile` for the present calibration of profile " +
+               std::to_string(activeProfile));
+    return;
+  }
+  const char* verb = save ? "Saving " : "Loading ";
+  const char* where = save ? "s to EEPROM" : "s from EEPROM";
+  if (all) {
+    println(std::string(verb) + "all arrays" + (save ? " to" : " from") +
+            " EEPROM");
+  }
+  uint16_t bytes = 0;
+  uint8_t step = 0;
+  for (const char* t : TYPES) {
+    step++;
+    if (!all && strcmp(type, t) != 0) {
+      continue;
+    }
+    const std::string progress =
+      all ? "(" + std::to_string(step) + "/4) " : std::string();
+    println(progress + verb + calibrationDescription(t) + where);
+    Array* memory = calibrationArray(t, false);
+    Array* eeprom = calibrationArray(t, true);
+    if (save) {
+      memcpy(*eeprom, *memory, sizeof(Array));
+    } else {
+      memcpy(*memory, *eeprom, sizeof(Array));
+    }
+    bytes += sizeof(Array);
+  }
+  if (bytes == 0) {
+    printError(std::string("Invalid calibration type: ") + type);
+    return;
+  }
+  if (!save) {
+    likelihoodsValid = false;
+  }
+  println(std::string(save ? "Bytes updated: " : "Bytes read: ") +
+          std::to_string(bytes));
+}
+
+// Loads the present calibration values and margins of a profile
+void SimulatedBoard::loadProfile(uint8_t profile) {
+  if (profile == 0) {
+    memcpy(presentValues, eepromPresentValues, sizeof(Array));
+    memcpy(presentMargins, eepromPresentMargins, sizeof(Array));
+  } else {
+    memcpy(presentValues, profilePresentValues[profile], sizeof(Array));
+    memcpy(presentMargins, profilePresentMargins[profile], sizeof(Array));
+  }
+  likelihoodsValid = false;
+}
+
+void SimulatedBoard::cmdProfile(char* args) {
+  const char* action = nextArg(args);
+  if (action == nullptr) {
+    printError("Missing action");
+    return;
+  }
+  if (strcmp(action, "list") == 0) {
+    println("Printing profiles");
+    for (uint8_t profile = 0; profile < PROFILES_NUM; profile++) {
+      println(std::to_string(profile) +
+              (profileSaved[profile] ? ": saved" : ": empty") +
+              (profile == activeProfile ? " (active)" : ""));
+    }
+    return;
+  }
+  const bool load = strcmp(action, "load") == 0;
+  if (!load && strcmp(action, "save") != 0) {
+    printError(std::string("Invalid action: ") + action);
+    return;
+  }
+  const char* numberStr = nextArg(args);
+  if (numberStr == nullptr) {
+    printError("Missing profile number");
+    return;
+  }
+  const int16_t profile = atoi(numberStr);
+  if (profile < 0 || profile >= PROFILES_NUM) {
+    printError(std::string("Invalid profile number: ") + numberStr);
+    return;
+  }
+
+  const uint16_t bytes =
+    profile == 0 ? 2 * sizeof(Array) : PROFILE_SIZE_IN_EEPROM;
+  if (load) {
+    if (!profileSaved[profile]) {
+      printError(std::string("Profile has not been saved: ") + numberStr);
+      return;
+    }
+    println("Loading profile " + std::to_string(profile));
+    loadProfile(profile);
+    println("Bytes read: " + std::to_string(bytes));
+  } else {
+    println("Saving profile " + std::to_string(profile));
+    if (profile == 0) {
+      memcpy(eepromPresentValues, presentValues, sizeof(Array));
+      memcpy(eepromPresentMargins, presentMargins, sizeof(Array));
+    } else {
+      uint8_t marginsClamped = 0;
+      for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+        for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+          const uint16_t margin = presentMargins[row][col];
+          if (margin > 0xFF) {
+            marginsClamped++;
+          }
+          profilePresentValues[profile][row][col] = presentValues[row][col];
+          profilePresentMargins[profile][row][col] = std::min<uint16_t>(
+            margin, 0xFF);
+        }
+      }
+      profileSaved[profile] = true;
+      if (marginsClamped > 0) {
+        println("Margins clamped to 255: " + std::to_string(marginsClamped));
+      }
+    }
+    println("Bytes updated: " + std::to_string(bytes));
+  }
+  activeProfile = profile;
+}
+
+void SimulatedBoard::cmdSettings(char* args) {
+  const char* action = nextArg(args);
+  if (action == nullptr) {
+    printError("Missing action");
+    return;
+  }
+  const bool set = strcmp(action, "set") == 0;
+  if (!set && strcmp(action, "get") != 0) {
+    printError(std::string("Invalid action: ") + action);
+    return;
+  }
+  const char* key = nextArg(args);
+  if (key == nullptr) {
+    printError("Missing key");
+    return;
+  }
+
+  struct Setting {
+    const char* key;
+    int32_t maxValue;
+    int32_t value;
+  };
+  Setting settings[] = {
+    {"AUTO_LOAD_CALIBRATION", 1, autoLoadCalibration},
+    {"DETECTION_METHOD", 4, detectionMethod},
+    {"PRINT_ON_BOARD_CHANGE", 1, printOnBoardChange},
+    {"ACTIVE_PROFILE", PROFILES_NUM - 1, activeProfile},
+    {"CROSSTALK_COMPENSATION", 1, crosstalkCompensation},
+    {"FAST_BOOT", 1, fastBoot},
+    {"MASK_UNHEALTHY_SQUARES", 1, maskUnhealthySquares},
+  };
+  Setting* setting = nullptr;
+  for (Setting& s : settings) {
+    if (strcmp(key, s.key) == 0) {
+      setting = &s;
+    }
+  }
+  if (setting == nullptr) {
+    printError(std::string("Invalid key: ") + key);
+    return;
+  }
+  if (!set) {
+    println(std::string("Printing ") + key + " setting value");
+    println(std::to_string(setting->value));
+    return;
+  }
+  const char* valueStr = nextArg(args);
+  if (valueStr == nullptr) {
+    printError("Missing value");
+    return;
+  }
+  const int32_t value = atoi(valueStr);
+  if (value < 0 || value > setting->maxValue ||
+      (setting == &settings[3] && !profileSaved[value])) {
+    printError(std::string("Invalid value for ") + key);
+    return;
+  }
+  println(std::string("Setting ") + key + " to " + std::to_string(value));
+  setting->value = value;
+  autoLoadCalibration = settings[0].value;
+  detectionMethod = settings[1].value;
+  printOnBoardChange = settings[2].value;
+  activeProfile = settings[3].value;
+  crosstalkCompensation = settings[4].value;
+  fastBoot = settings[5].value;
+  maskUnhealthySquares = settings[6].value;
+  if (setting == &settings[3]) {
+    loadProfile(activeProfile);
+  }
+}
+
+void SimulatedBoard::cmdHealth(char* args) {
+  const char* action = nextArg(args);
+  if (action != nullptr) {
+    if (strcmp(action, "reset") != 0) {
+      printError(std::string("Invalid action: ") + action);
+      return;
+    }
+    println("Resetting sensor health");
+    memset(health, 0, sizeof(health));
+    unhealthySquares = 0;
+    return;
+  }
+
+  println("Printing sensor health");
+  uint8_t suspectSquares = 0;
+  uint8_t suspectChannels = 0xFF;
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    uint8_t expanderSuspectSquares = 0;
+    uint8_t expanderSuspectChannels = 0;
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      const uint8_t flags = healthFlags(
+        values[row][col], presentValues[row][col], emptyValues[row][col],
+        presentMargins[row][col], emptyMargins[row][col], health[row][col]);
+      if (flags == 0) {
+        continue;
+      }
+      suspectSquares++;
+      expanderSuspectSquares++;
+      expanderSuspectChannels |= 1 << col;
+      std::string line = std::to_string(row) + "," + std::to_string(col) + ":";
+      if (flags & HEALTH_RAILED) {
+        line += " railed";
+      }
+      if (flags & HEALTH_STUCK) {
+        line += " stuck";
+      }
+      if (flags & HEALTH_NOISY) {
+        line += " noisy";
+      }
+      println(line + " (value " + std::to_string(values[row][col]) +
+              ", average change " +
+              formatFloat(static_cast<double>(health[row][col].noise) /
+                          HEALTH_NOISE_SCALE) +
+              ")");
+    }
+    suspectChannels &= expanderSuspectChannels;
+    if (expanderSuspectSquares >= EXPANDER_SUSPECT_SQUARES) {
+      println("Suspect expander " + std::to_string(row) + " on pin A" +
+              std::to_string(EXPANDER_ANALOG_PINS[row]) + " with " +
+              std::to_string(expanderSuspectSquares) + " suspect channels");
+    }
+  }
+  for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+    if (suspectChannels & (1 << col)) {
+      println("Channel " + std::to_string(EXPANDER_COLS_TO_BITS[col]) +
+              " (column " + std::to_string(col) +
+              ") is suspect on every expander, check the select pins");
+    }
+  }
+  println("Suspect squares: " + std::to_string(suspectSquares));
+  println("Masked from board changes: " +
+          std::to_string(maskUnhealthySquares ? suspectSquares : 0));
+}
+
+void SimulatedBoard::printStreamStats() {
+  const uint32_t elapsed =
+    (streaming ? millis() : streamStopTime) - streamStartTime;
+  println("Frames sent: " + std::to_string(streamFrames));
+  println("Bytes sent: " + std::to_string(streamBytes));
+  if (streamFrames == 0 || elapsed == 0) {
+    return;
+  }
+  println("Bytes per frame: " +
+          formatFloat(static_cast<double>(streamBytes) / streamFrames));
+  println("Compression ratio: " +
+          formatFloat(static_cast<double>(streamFrames) *
+                      TELEMETRY_RAW_FRAME_SIZE / streamBytes));
+  println("Frames per second: " + formatFloat(streamFrames * 1000.0 / elapsed));
+}
+
+void SimulatedBoard::cmdStream(char* args) {
+  const char* action = nextArg(args);
+  if (action == nullptr) {
+    printError("Missing action");
+    return;
+  }
+  if (strcmp(action, "start") == 0) {
+    if (tracing) {
+      printError("Stop tracing before streaming");
+      return;
+    }
+    const char* intervalStr = nextArg(args);
+    uint8_t interval = 32;
+    if (intervalStr != nullptr) {
+      const int16_t value = atoi(intervalStr);
+      if (value < 1 || value > 255) {
+        printError(std::string("Invalid keyframe interval: ") + intervalStr);
+        return;
+      }
+      interval = value;
+    }
+    println("Starting stream with a keyframe every " +
+            std::to_string(interval) + " frames");
+    streamKeyframeInterval = interval;
+    streamSequence = 0;
+    streamFrames = 0;
+    streamBytes = 0;
+    streamStartTime = millis();
+    streaming = true;
+  } else if (strcmp(action, "stop") == 0) {
+    if (streaming) {
+      streamStopTime = millis();
+    }
+    streaming = false;
+    println("Stopped stream");
+    printStreamStats();
+  } else if (strcmp(action, "stats") == 0) {
+    println("Printing stream statistics");
+    printStreamStats();
+  } else {
+    printError(std::string("Invalid action: ") + action);
+  }
+}
+
+void SimulatedBoard::cmdCrosstalk(char* args) {
+  const char* action = nextArg(args);
+  if (action == nullptr) {
+    printError("Missing action");
+    return;
+  }
+  if (strcmp(action, "get") == 0) {
+    println("Printing orthogonal and diagonal crosstalk coefficients");
+    for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+      std::string line;
+      for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+        const uint8_t packed = crosstalk[row][col];
+        line += std::to_string(detectionCrosstalkOrthogonal(packed)) + "," +
+                std::to_string(detectionCrosstalkDiagonal(packed)) + "  ";
+      }
+      println(line);
+    }
+    return;
+  } else if (strcmp(action, "clear") == 0) {
+    println("Clearing crosstalk coefficients");
+    memset(crosstalk, 0, sizeof(crosstalk));
+    return;
+  } else if (strcmp(action, "save") == 0) {
+    println("Saving crosstalk coefficients to EEPROM");
+    memcpy(eepromCrosstalk, crosstalk, sizeof(crosstalk));
+    return;
+  } else if (strcmp(action, "load") == 0) {
+    println("Loading crosstalk coefficients from EEPROM");
+    memcpy(crosstalk, eepromCrosstalk, sizeof(crosstalk));
+    return;
+  } else if (strcmp(action, "measure") != 0) {
+    printError(std::string("Invalid action: ") + action);
+    return;
+  }
+
+  char* position = nextArg(args);
+  const char* rowStr = position == nullptr ? nullptr : strsep(&position, ",");
+  const char* colStr = position;
+  if (rowStr == nullptr) {
+    printError("Missing position");
+    return;
+  }
+  if (colStr == nullptr) {
+    printError("Invalid position");
+    return;
+  }
+  const uint8_t row = atoi(rowStr);
+  const uint8_t col = atoi(colStr);
+  if (row >= CHESSBOARD_ROWS || col >= CHESSBOARD_COLS) {
+    printError("Invalid position");
+    return;
+  }
+
+  println("Measuring crosstalk for row " + std::to_string(row) + " col " +
+          std::to_string(col));
+  // Like linearHallsReadNeighbourhood(), averaging a few scans
+  const uint8_t SCANS = 8;
+  uint16_t averages[3][3] = {};
+  for (uint8_t scan = 0; scan < SCANS; scan++) {
+    readSensors();
+    for (int8_t dRow = -1; dRow <= 1; dRow++) {
+      for (int8_t dCol = -1; dCol <= 1; dCol++) {
+        const int8_t r = row + dRow;
+        const int8_t c = col + dCol;
+        if (r >= 0 && r < CHESSBOARD_ROWS && c >= 0 && c < CHESSBOARD_COLS) {
+          averages[dRow + 1][dCol + 1] += values[r][c];
+        }
+      }
+    }
+  }
+  for (auto& averageRow : averages) {
+    for (uint16_t& average : averageRow) {
+      average /= SCANS;
+    }
+  }
+  const int16_t sourceShift = averages[1][1] - emptyValues[row][col];
+  if (abs(sourceShift) <= emptyMargins[row][col]) {
+    printError("No piece detected on the square");
+    return;
+  }
+  int32_t orthogonalShift = 0;
+  int32_t diagonalShift = 0;
+  uint8_t orthogonalCount = 0;
+  uint8_t diagonalCount = 0;
+  for (int8_t dRow = -1; dRow <= 1; dRow++) {
+    for (int8_t dCol = -1; dCol <= 1; dCol++) {
+      const int8_t r = row + dRow;
+      const int8_t c = col + dCol;
+      if ((dRow == 0 && dCol == 0) || r < 0 || r >= CHESSBOARD_ROWS || c < 0 ||
+          c >= CHESSBOARD_COLS) {
+        continue;
+      }
+      const int16_t shift = averages[dRow + 1][dCol + 1] - emptyValues[r][c];
+      if (dRow == 0 || dCol == 0) {
+        orthogonalShift += shift;
+        orthogonalCount++;
+      } else {
+        diagonalShift += shift;
+        diagonalCount++;
+      }
+    }
+  }
+  const auto coefficient = [&](int32_t shift, uint8_t count) {
+    const long value = lround(shift * 64.0 / (sourceShift * count));
+    return static_cast<int8_t>(std::min<long>(
+      std::max<long>(value, DETECTION_CROSSTALK_MIN), DETECTION_CROSSTALK_MAX));
+  };
+  const int8_t orthogonal = coefficient(orthogonalShift, orthogonalCount);
+  const int8_t diagonal = coefficient(diagonalShift, diagonalCount);
+  crosstalk[row][col] = detectionPackCrosstalk(orthogonal, diagonal);
+  println("Orthogonal and diagonal coefficients: " +
+          std::to_string(orthogonal) + "," + std::to_string(diagonal));
+}
+
+void SimulatedBoard::cmdTrace(char* args) {
+  const char* action = nextArg(args);
+  if (action == nullptr) {
+    printError("Missing action");
+    return;
+  }
+  if (strcmp(action, "start") == 0) {
+    if (streaming) {
+      printError("Stop streaming before tracing");
+      return;
+    }
+    println("Starting trace");
+    traceHeaderPending = true;
+    tracing = true;
+  } else if (strcmp(action, "stop") == 0) {
+    traceHeaderPending = false;
+    tracing = false;
+    println("Stopped trace");
+  } else {
+    printError(std::string("Invalid action: ") + action);
+  }
+}
+
+void SimulatedBoard::cmdTasks(char* args) {
+  const char* action = nextArg(args);
+  if (action != nullptr) {
+    if (strcmp(action, "reset") != 0) {
+      printError(std::string("Invalid action: ") + action);
+      return;
+    }
+    println("Resetting task statistics");
+    for (TaskStats& task : tasks) {
+      task.runs = 0;
+      task.totalRuntimeUs = 0;
+      task.maxRuntimeUs = 0;
+      task.deadlineMisses = 0;
+      task.budgetOverruns = 0;
+    }
+    statsStartTime = millis();
+    passes = 0;
+    idlePasses = 0;
+    overheadUs = 0;
+    return;
+  }
+
+  const uint32_t elapsed = millis() - statsStartTime;
+  println("Printing task statistics");
+  println("Time (ms): " + std::to_string(elapsed));
+  println("Scheduler passes: " + std::to_string(passes) +
+          ", idle: " + std::to_string(idlePasses));
+  const uint32_t taskRuns = passes - idlePasses;
+  println("Scheduler overhead (us per task run): " +
+          formatFloat(taskRuns == 0 ? 0.0
+                                    : static_cast<double>(overheadUs) /
+                                        taskRuns));
+  for (const TaskStats& task : tasks) {
+    println(
+      std::string(task.name) + ": runs " + std::to_string(task.runs) +
+      ", average (us) " +
+      formatFloat(task.runs == 0
+                    ? 0.0
+                    : static_cast<double>(task.totalRuntimeUs) / task.runs) +
+      ", max (us) " + std::to_string(task.maxRuntimeUs) + ", load (%) " +
+      formatFloat(elapsed == 0 ? 0.0 : task.totalRuntimeUs / 10.0 / elapsed) +
+      ", deadline misses " + std::to_string(task.deadlineMisses) +
+      ", budget overruns " + std::to_string(task.budgetOverruns));
+  }
+}
@@ -0,0 +1,212 @@
+#ifndef SIMULATED_BOARD_H
+#define SIMULATED_BOARD_H
+
+#include "Detection.h"
+#include "Health.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+// Emulates the firmware on the master side of a pseudo-terminal, so clients can
+// open path() like the board's serial port.
+//
+// Sensors read the empty or present value of each square plus a little noise,
+// and every frame goes through the same piece detection as the firmware
+// (Detection.h), reporting `Board changed:` when PRINT_ON_BOARD_CHANGE is on.
+//
+// Every command is emulated with the firmware's replies, plain or tagged, except
+// `print boot` as the simulator doesn't save the board state. "EEPROM" only
+// lives as long as the SimulatedBoard. Sensor health, crosstalk compensation,
+// `stream` and `trace` work on the simulated readings like on real ones, and
+// `tasks` times the simulator's own command handling (serial) and frames
+// (detect) on the host. The simulated sensors are read all at once and nothing
+// is saved in the background, so the scan and eeprom tasks never run.
+//
+// Like the firmware's serial port, output goes out at baudRate and the board
+// stalls while more than TX_BUFFER_SIZE bytes are waiting to go out. Input
+// meanwhile piles up in a RX_BUFFER_SIZE byte receive buffer, and whatever
+// doesn't fit is dropped. (see droppedBytes())
+class SimulatedBoard {
+  public:
+    // framePeriodUs is the time between frames, the firmware takes about 80 ms.
+    // A baudRate of 0 sends output instantly and never drops input.
+    explicit SimulatedBoard(uint32_t framePeriodUs = 80000,
+                            uint32_t baudRate = 115200);
+    ~SimulatedBoard();
+    SimulatedBoard(const SimulatedBoard&) = delete;
+    SimulatedBoard& operator=(const SimulatedBoard&) = delete;
+
+    bool start();
+    void stop();
+    const std::string& path() const {
+      return slavePath;
+    }
+
+    // The pieces on the board, picked up by the next frame. Any thread.
+    void setPieces(uint64_t pieces) {
+      targetPieces.store(pieces, std::memory_order_relaxed);
+    }
+    uint64_t framesScanned() const {
+      return frames.load(std::memory_order_relaxed);
+    }
+    // Input lost to a full receive buffer
+    uint64_t droppedBytes() const {
+      return dropped.load(std::memory_order_relaxed);
+    }
+
+    // Readings the sensors produce for empty and occupied squares
+    static const uint16_t EMPTY_VALUE = 512;
+    static const uint16_t PRESENT_VALUE = 700;
+    static const uint16_t NOISE = 3;
+
+    // SERIAL_RX_BUFFER_SIZE in platformio.ini, a ring buffer holding one less,
+    // and the default SERIAL_TX_BUFFER_SIZE
+    static const size_t RX_BUFFER_SIZE = 128;
+    static const size_t TX_BUFFER_SIZE = 64;
+
+  private:
+    typedef uint16_t Array[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+
+    // Statistics of a firmware task, see Scheduler.h
+    struct TaskStats {
+      const char* name;
+      uint32_t deadlineUs;
+      uint32_t budgetUs;
+      uint32_t runs;
+      uint64_t totalRuntimeUs;
+      uint32_t maxRuntimeUs;
+      uint32_t deadlineMisses;
+      uint32_t budgetOverruns;
+    };
+
+    // Profile 0 is the calibration in "EEPROM", like the firmware
+    static const uint8_t PROFILES_NUM = 3;
+
+    void run();
+    void runTask(TaskStats& task, uint64_t readyTime, uint64_t passStart,
+                 void (SimulatedBoard::*function)());
+    void serialTask();
+    void scanFrame();
+    void handleLine(const std::string& line);
+    void runCommand(const char* name, char* args);
+    void cmdPrint(char* args);
+    void cmdCalibrate(char* args);
+    void cmdCalibrationEEPROM(char* args, bool save);
+    void cmdProfile(char* args);
+    void cmdSettings(char* args);
+    void cmdHealth(char* args);
+    void cmdStream(char* args);
+    void cmdCrosstalk(char* args);
+    void cmdTrace(char* args);
+    void cmdTasks(char* args);
+    void printError(const std::string& message);
+    void println(const std::string& line = "");
+    void printArray(const Array array, uint8_t thisRowOnly = 255,
+                    uint8_t thisColOnly = 255);
+    void printBitboard(uint64_t bitboard);
+    void printStreamStats();
+    Array* calibrationArray(const char* type, bool eeprom);
+    void readSensors();
+    void loadProfile(uint8_t profile);
+    void traceWriteHeader();
+    void traceWriteFrame();
+    void streamWriteFrame();
+    void writeBytes(const void* data, size_t size);
+    uint64_t micros() const;
+    uint32_t millis() const {
+      return micros() / 1000;
+    }
+    void flush();
+    void receive();
+    void transmit();
+
+    uint32_t framePeriodUs;
+    std::chrono::nanoseconds byteTime; // 10 bits per byte, 0 for instant
+    int masterFd = -1;
+    int slaveFd = -1;
+    std::string slavePath;
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::atomic<uint64_t> targetPieces{0};
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> dropped{0};
+
+    // Firmware state, only touched by the thread
+    Array values = {};
+    Array previousValues = {};
+    Array presentValues = {};
+    Array emptyValues = {};
+    Array presentMargins = {};
+    Array emptyMargins = {};
+    Array eepromPresentValues = {};
+    Array eepromEmptyValues = {};
+    Array eepromPresentMargins = {};
+    Array eepromEmptyMargins = {};
+    DetectionLikelihood likelihoods[CHESSBOARD_ROWS][CHESSBOARD_COLS] = {};
+    bool likelihoodsValid = false;
+    uint8_t confidence[CHESSBOARD_ROWS][CHESSBOARD_COLS] = {};
+    uint64_t pieces = 0;
+    uint64_t previousPieces = 0;
+    uint32_t noiseState = 1;
+    bool firstFrame = true;
+    SensorHealth health[CHESSBOARD_ROWS][CHESSBOARD_COLS] = {};
+    uint64_t unhealthySquares = 0;
+    uint8_t crosstalk[CHESSBOARD_ROWS][CHESSBOARD_COLS] = {};
+    uint8_t eepromCrosstalk[CHESSBOARD_ROWS][CHESSBOARD_COLS] = {};
+    // Profiles 1 and 2, margins are clamped to 255 like in the firmware
+    bool profileSaved[PROFILES_NUM] = {true};
+    Array profilePresentValues[PROFILES_NUM] = {};
+    Array profilePresentMargins[PROFILES_NUM] = {};
+
+    bool tracing = false;
+    bool traceHeaderPending = false;
+    bool streaming = false;
+    uint8_t streamKeyframeInterval = 32;
+    uint8_t streamSequence = 0;
+    uint32_t streamFrames = 0;
+    uint32_t streamBytes = 0;
+    uint32_t streamStartTime = 0;
+    uint32_t streamStopTime = 0;
+
+    std::chrono::steady_clock::time_point startTime;
+    TaskStats tasks[4] = {
+      // name, deadlineUs, budgetUs as in the firmware
+      {"serial", 5000, 1000, 0, 0, 0, 0, 0},
+      {"detect", 5000, 5000, 0, 0, 0, 0, 0},
+      {"scan", 5000, 2000, 0, 0, 0, 0, 0},
+      {"eeprom", 50000, 30000, 0, 0, 0, 0, 0},
+    };
+    uint32_t statsStartTime = 0;
+    uint32_t passes = 0;
+    uint32_t idlePasses = 0;
+    uint64_t overheadUs = 0;
+    // micros() when the receive buffer last had input waiting to be run
+    uint64_t inputReadyTime = 0;
+
+    bool autoLoadCalibration = true;
+    // Method 0 needs overlapping calibration ranges, which the simulated
+    // sensors don't have
+    uint8_t detectionMethod = DETECTION_METHOD_LIKELIHOOD;
+    bool printOnBoardChange = false;
+    uint8_t activeProfile = 0;
+    bool crosstalkCompensation = false;
+    bool fastBoot = false;
+    bool maskUnhealthySquares = false;
+
+    std::string output;
+    std::string linePrefix;
+    std::string line;
+    std::string incoming; // Read from the pseudo-terminal, still on the wire
+    std::string receiveBuffer;
+    std::string transmitBuffer;
+    // When the first byte of incoming has arrived and the first byte of
+    // transmitBuffer has gone out
+    std::chrono::steady_clock::time_point nextArrivalTime;
+    std::chrono::steady_clock::time_point nextTransmitTime;
+    uint8_t commandStatus = 0;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+// Lock-free ring buffer for exactly one producer thread and one consumer
+// thread. Capacity must be a power of two, one slot is kept free to tell a full
+// queue from an empty one.
+template <typename T, size_t Capacity> class SpscQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+
+  public:
+    // Producer only. Returns false if the queue is full.
+    bool push(const T& item) {
+      const size_t tail = this->tail.load(std::memory_order_relaxed);
+      const size_t next = (tail + 1) & (Capacity - 1);
+      if (next == head.load(std::memory_order_acquire)) {
+        return false;
+      }
+      items[tail] = item;
+      this->tail.store(next, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty.
+    bool pop(T& item) {
+      const size_t head = this->head.load(std::memory_order_relaxed);
+      if (head == tail.load(std::memory_order_acquire)) {
+        return false;
+      }
+      item = items[head];
+      this->head.store((head + 1) & (Capacity - 1), std::memory_order_release);
+      return true;
+    }
+
+  private:
+    // On separate cache lines so the threads don't keep stealing them
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    T items[Capacity];
+};
+
+#endif
@@ -0,0 +1,225 @@
+// Benchmarks the client library (see ChessboardClient.h) against a simulated
+// board (see SimulatedBoard.h) on a pseudo-terminal: round-trip latency and
+// throughput of commands, one at a time and pipelined, uploading a whole
+// calibration array, and the latency and rate of board change notifications.
+//
+// The simulator sends at the firmware's baud rate and drops input that
+// overflows its receive buffer like the firmware, so commands take about as
+// long as on a real board and input lost to pipelining too much shows up.
+// With --baud 0 it answers instantly, which measures the host side.
+//
+// Usage: bench [--commands N] [--window N] [--uploads N] [--changes N]
+//     [--frame-us N] [--baud N]
+//   --commands N  Commands per command benchmark. (100)
+//   --window N    Bytes of pipelined commands in flight at once, at most
+//                 ChessboardClient::MAX_BYTES_IN_FLIGHT. (127)
+//   --uploads N   Times to upload a whole calibration array. (5)
+//   --changes N   Board changes to time. (100)
+//   --frame-us N  Time between simulated frames in microseconds, change
+//                 latency includes waiting for the next frame. (1000)
+//   --baud N      Baud rate of the simulated board, 0 for instant. (115200)
+
+#include "ChessboardClient.h"
+#include "SimulatedBoard.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double microseconds(Clock::duration duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+// Prints the rate and latency percentiles of a run
+static void report(const char* name, std::vector<double>& latencies,
+                   Clock::duration elapsed) {
+  std::sort(latencies.begin(), latencies.end());
+  const size_t n = latencies.size();
+  printf("%-22s %8.0f/s", name, n / (microseconds(elapsed) / 1e6));
+  if (n > 0) {
+    printf("  latency us: p50 %7.1f  p99 %7.1f  max %7.1f",
+           latencies[n / 2], latencies[n * 99 / 100], latencies[n - 1]);
+  }
+  printf("\n");
+}
+
+static bool benchRoundTrips(ChessboardClient& client, uint32_t count) {
+  std::vector<double> latencies;
+  const Clock::time_point start = Clock::now();
+  for (uint32_t i = 0; i < count; i++) {
+    const Clock::time_point sent = Clock::now();
+    uint64_t pieces;
+    if (!client.getBoard(pieces)) {
+      fprintf(stderr, "getBoard failed\n");
+      return false;
+    }
+    latencies.push_back(microseconds(Clock::now() - sent));
+  }
+  report("getBoard", latencies, Clock::now() - start);
+
+  latencies.clear();
+  const Clock::time_point rawStart = Clock::now();
+  for (uint32_t i = 0; i < count; i++) {
+    const Clock::time_point sent = Clock::now();
+    SquareValues values;
+    if (!client.getRawFrame(values)) {
+      fprintf(stderr, "getRawFrame failed\n");
+      return false;
+    }
+    latencies.push_back(microseconds(Clock::now() - sent));
+  }
+  report("getRawFrame", latencies, Clock::now() - rawStart);
+  return true;
+}
+
+static bool benchPipelined(ChessboardClient& client, uint32_t count,
+                           uint32_t window) {
+  static const char COMMAND[] = "settings get DETECTION_METHOD";
+  const size_t size = ChessboardClient::requestSize(COMMAND);
+  std::vector<double> latencies;
+  std::deque<std::pair<uint16_t, Clock::time_point>> inFlight;
+  const Clock::time_point start = Clock::now();
+  uint32_t sent = 0;
+  while (sent < count || !inFlight.empty()) {
+    // Always at least one, however small the window
+    while (sent < count &&
+           (inFlight.empty() || (inFlight.size() + 1) * size <= window)) {
+      inFlight.emplace_back(client.sendCommand(COMMAND), Clock::now());
+      sent++;
+    }
+    CommandReply reply;
+    if (!client.waitReply(inFlight.front().first, reply) || reply.status != 0) {
+      fprintf(stderr, "Pipelined command failed\n");
+      return false;
+    }
+    latencies.push_back(microseconds(Clock::now() - inFlight.front().second));
+    inFlight.pop_front();
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "pipelined (%zu at once)",
+           std::max<size_t>(window / size, 1));
+  report(name, latencies, Clock::now() - start);
+  return true;
+}
+
+static bool benchSetCalibration(ChessboardClient& client, uint32_t count) {
+  SquareValues values;
+  if (!client.getCalibration(CalibrationType::Present, values)) {
+    fprintf(stderr, "getCalibration failed\n");
+    return false;
+  }
+  std::vector<double> latencies;
+  const Clock::time_point start = Clock::now();
+  for (uint32_t i = 0; i < count; i++) {
+    const Clock::time_point sent = Clock::now();
+    if (!client.setCalibration(CalibrationType::Present, values)) {
+      fprintf(stderr, "setCalibration failed\n");
+      return false;
+    }
+    latencies.push_back(microseconds(Clock::now() - sent));
+  }
+  // Whole uploads of 64 commands per second
+  report("setCalibration (64)", latencies, Clock::now() - start);
+  return true;
+}
+
+static bool benchChanges(ChessboardClient& client, SimulatedBoard& board,
+                         uint32_t count) {
+  if (!client.subscribeChanges(true)) {
+    fprintf(stderr, "subscribeChanges failed\n");
+    return false;
+  }
+  std::vector<double> readerLatencies;
+  std::vector<double> latencies;
+  uint64_t pieces = 0;
+  const Clock::time_point start = Clock::now();
+  for (uint32_t i = 0; i < count; i++) {
+    pieces ^= 1ULL << (i % 64);
+    const Clock::time_point changed = Clock::now();
+    board.setPieces(pieces);
+    BoardChange change;
+    if (!client.waitChange(change, std::chrono::milliseconds(1000))) {
+      fprintf(stderr, "No change notification\n");
+      return false;
+    }
+    latencies.push_back(microseconds(Clock::now() - changed));
+    readerLatencies.push_back(microseconds(change.receivedTime - changed));
+    if (change.pieces != pieces) {
+      fprintf(stderr, "Change notification has the wrong board\n");
+      return false;
+    }
+  }
+  const Clock::duration elapsed = Clock::now() - start;
+  report("change (reader)", readerLatencies, elapsed);
+  report("change (consumer)", latencies, elapsed);
+  printf("Dropped changes: %llu\n",
+         static_cast<unsigned long long>(client.droppedChanges()));
+  return client.subscribeChanges(false);
+}
+
+int main(int argc, char** argv) {
+  uint32_t commands = 100;
+  uint32_t window = ChessboardClient::MAX_BYTES_IN_FLIGHT;
+  uint32_t uploads = 5;
+  uint32_t changes = 100;
+  uint32_t framePeriodUs = 1000;
+  uint32_t baudRate = 115200;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      fprintf(stderr, "Missing value for %s\n", argv[i]);
+      return 1;
+    }
+    const uint32_t value = strtoul(argv[i + 1], nullptr, 10);
+    if (strcmp(argv[i], "--commands") == 0) {
+      commands = value;
+    } else if (strcmp(argv[i], "--window") == 0) {
+      if (value > ChessboardClient::MAX_BYTES_IN_FLIGHT) {
+        fprintf(stderr, "--window is at most %zu bytes\n",
+                ChessboardClient::MAX_BYTES_IN_FLIGHT);
+        return 1;
+      }
+      window = value;
+    } else if (strcmp(argv[i], "--uploads") == 0) {
+      uploads = value;
+    } else if (strcmp(argv[i], "--changes") == 0) {
+      changes = value;
+    } else if (strcmp(argv[i], "--frame-us") == 0) {
+      framePeriodUs = value > 0 ? value : 1;
+    } else if (strcmp(argv[i], "--baud") == 0) {
+      baudRate = value;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+    i++;
+  }
+
+  SimulatedBoard board(framePeriodUs, baudRate);
+  if (!board.start()) {
+    return 1;
+  }
+  ChessboardClient client;
+  if (!client.open(board.path()) ||
+      !client.waitReady(std::chrono::milliseconds(1000))) {
+    fprintf(stderr, "Simulated board not ready\n");
+    return 1;
+  }
+  printf("Simulated board on %s, frame every %u us, %u baud\n",
+         board.path().c_str(), framePeriodUs, baudRate);
+
+  const bool ok = benchRoundTrips(client, commands) &&
+                  benchPipelined(client, commands, window) &&
+                  benchSetCalibration(client, uploads) &&
+                  benchChanges(client, board, changes);
+  printf("Bytes dropped by the simulated board: %llu\n",
+         static_cast<unsigned long long>(board.droppedBytes()));
+  client.close();
+  board.stop();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+// Checks the sensor health tracking (see include/Health.h) on synthetic
+// readings: real piece moves and calibrated noise must not flag a square,
+// while noisy and stuck sensors must.
+//
+// Usage: health_test, exits with 1 if any check fails
+
+#include "Health.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+typedef uint16_t Array[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+
+static int failures = 0;
+
+static void check(bool condition, const char* name) {
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", name);
+  if (!condition) {
+    failures++;
+  }
+}
+
+static void fill(Array array, uint16_t value) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      array[row][col] = value;
+    }
+  }
+}
+
+// Feeds frames of square 0,0 from reading(frame) to healthUpdate, every other
+// square reads its empty value plus the same noise. Returns the flags of 0,0
+// ORed over every frame from the first one checked.
+template <typename Reading>
+static uint8_t run(uint16_t presentMargin, uint16_t emptyMargin,
+                   uint32_t frames, uint32_t firstChecked, Reading reading) {
+  Array present, empty, presentMargins, emptyMargins, values, previous;
+  fill(present, 800);
+  fill(empty, 512);
+  fill(presentMargins, presentMargin);
+  fill(emptyMargins, emptyMargin);
+  SensorHealth health[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  memset(health, 0, sizeof(health));
+  fill(values, 512);
+  uint8_t flags = 0;
+  for (uint32_t frame = 0; frame < frames; frame++) {
+    memcpy(previous, values, sizeof(values));
+    fill(values, 512);
+    values[0][0] = reading(frame);
+    healthUpdate(values, previous, present, empty, presentMargins,
+                 emptyMargins, health);
+    if (frame >= firstChecked) {
+      flags |= healthFlags(values[0][0], present[0][0], empty[0][0],
+                           presentMargins[0][0], emptyMargins[0][0],
+                           health[0][0]);
+    }
+  }
+  return flags;
+}
+
+int main() {
+  std::mt19937 random(1);
+
+  // Margins as 2 standard deviations of the noise
+  std::normal_distribution<double> noise(0, 15 / 2.0);
+  const auto noisyReading = [&](bool present) {
+    const double value = (present ? 800 : 512) + noise(random);
+    return static_cast<uint16_t>(value + 0.5);
+  };
+
+  // A piece placed and removed a few times, 288 steps each way
+  check((run(15, 10, 2000, 0,
+             [&](uint32_t frame) {
+               return noisyReading((frame / 200) % 2);
+             }) &
+         HEALTH_NOISY) == 0,
+        "piece moves aren't noisy");
+  // Moves on consecutive frames, like a piece slid over the square
+  check((run(15, 10, 400, 0,
+             [&](uint32_t frame) {
+               return noisyReading(frame >= 100 && frame < 102);
+             }) &
+         HEALTH_NOISY) == 0,
+        "piece slid over a square isn't noisy");
+  check((run(15, 10, 5000, 0,
+             [&](uint32_t) { return noisyReading(false); }) &
+         HEALTH_NOISY) == 0,
+        "calibrated noise isn't noisy");
+
+  // A bad sensor jumping by 3 margins every frame
+  check((run(15, 10, 200, 100,
+             [](uint32_t frame) {
+               return static_cast<uint16_t>(frame % 2 ? 512 + 45 : 512);
+             }) &
+         HEALTH_NOISY) != 0,
+        "sensor jumping by 3 margins is noisy");
+  // Twice the calibrated noise, sampled once it has settled
+  std::normal_distribution<double> doubleNoise(0, 15.0);
+  check((run(15, 10, 400, 200,
+             [&](uint32_t) {
+               return static_cast<uint16_t>(512 + doubleNoise(random) + 0.5);
+             }) &
+         HEALTH_NOISY) != 0,
+        "twice the calibrated noise is noisy");
+
+  check((run(15, 10, 300, 299, [](uint32_t) { return uint16_t(512); }) &
+         HEALTH_STUCK) != 0,
+        "unchanging sensor is stuck");
+  check((run(15, 10, 10, 0, [](uint32_t) { return uint16_t(1023); }) &
+         HEALTH_RAILED) != 0,
+        "sensor at 1023 is railed");
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,342 @@
+// Replays a raw-frame trace (see include/Trace.h) through the same sensor health
+// checks and piece detection the firmware runs and reports the resulting board
+// changes, how many of them were false (one of their squares flipped back
+// within --settle frames) and how many frames per second the detection
+// processes on this machine.
+//
+// Usage: replay <trace file> [--method N] [--crosstalk N] [--mask N]
+//     [--settle N] [--repeat N] [--quiet]
+//   --method N     Override the DETECTION_METHOD recorded in the trace header.
+//   --crosstalk N  Override the CROSSTALK_COMPENSATION recorded in the trace
+//                  header. (version 1 traces have no crosstalk coefficients)
+//   --mask N       Override the MASK_UNHEALTHY_SQUARES recorded in the trace
+//                  header. (0 for version 1 and 2 traces)
+//   --settle N     A change counts as false if any of its squares flips back
+//                  within N frames. (3)
+//   --repeat N     Times to classify the whole trace for the benchmark. (100)
+//   --quiet        Only print the summary.
+
+#include "Detection.h"
+#include "Health.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+struct Trace {
+  uint8_t detectionMethod;
+  uint16_t presentValues[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  uint16_t emptyValues[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  uint16_t presentMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  uint16_t emptyMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  DetectionLikelihood likelihoods[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  bool crosstalkCompensation;
+  uint8_t crosstalk[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  bool maskUnhealthySquares;
+  // Detection state before the first frame
+  uint64_t pieces;
+  uint16_t previousValues[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  SensorHealth health[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  std::vector<uint32_t> timestamps;
+  std::vector<uint16_t> values; // CHESSBOARD_ROWS * CHESSBOARD_COLS per frame
+};
+
+static uint16_t readU16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t readU32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void readArray(const uint8_t* p,
+                      uint16_t array[CHESSBOARD_ROWS][CHESSBOARD_COLS]) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      array[row][col] = readU16(p);
+      p += sizeof(uint16_t);
+    }
+  }
+}
+
+static bool loadTrace(const char* path, Trace& trace) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+  const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                                  std::istreambuf_iterator<char>());
+
+  // Captures off the serial port can start with command output, so look for
+  // the magic instead of expecting it at offset 0
+  size_t pos = 0;
+  while (pos + TRACE_HEADER_V1_SIZE <= data.size() &&
+         memcmp(&data[pos], TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+    pos++;
+  }
+  if (pos + TRACE_HEADER_V1_SIZE > data.size()) {
+    fprintf(stderr, "No trace header found in %s\n", path);
+    return false;
+  }
+  const uint8_t* header = &data[pos + sizeof(TRACE_MAGIC)];
+  const uint8_t version = header[0];
+  const size_t headerSize = version == 1   ? TRACE_HEADER_V1_SIZE
+                            : version == 2 ? TRACE_HEADER_V2_SIZE
+                                           : TRACE_HEADER_SIZE;
+  if (version < 1 || version > TRACE_VERSION) {
+    fprintf(stderr, "Unsupported trace version %u\n", version);
+    return false;
+  }
+  if (pos + headerSize > data.size()) {
+    fprintf(stderr, "Truncated trace header in %s\n", path);
+    return false;
+  }
+  if (header[1] != CHESSBOARD_ROWS || header[2] != CHESSBOARD_COLS) {
+    fprintf(stderr, "Unsupported board size %ux%u\n", header[1], header[2]);
+    return false;
+  }
+  trace.detectionMethod = header[3];
+  readArray(header + 4, trace.presentValues);
+  readArray(header + 4 + TRACE_ARRAY_SIZE, trace.emptyValues);
+  readArray(header + 4 + 2 * TRACE_ARRAY_SIZE, trace.presentMargins);
+  readArray(header + 4 + 3 * TRACE_ARRAY_SIZE, trace.emptyMargins);
+  detectionUpdateLikelihoods(trace.presentMargins, trace.emptyMargins,
+                             trace.likelihoods);
+  trace.crosstalkCompensation = false;
+  memset(trace.crosstalk, 0, sizeof(trace.crosstalk));
+  if (version >= 2) {
+    const uint8_t* crosstalk = header + 4 + 4 * TRACE_ARRAY_SIZE;
+    trace.crosstalkCompensation = crosstalk[0];
+    memcpy(trace.crosstalk, crosstalk + 1, sizeof(trace.crosstalk));
+  }
+  trace.maskUnhealthySquares = false;
+  trace.pieces = 0;
+  memset(trace.health, 0, sizeof(trace.health));
+  if (version >= 3) {
+    const uint8_t* state = header + TRACE_HEADER_V2_SIZE - sizeof(TRACE_MAGIC);
+    trace.maskUnhealthySquares = state[0];
+    trace.pieces = readU32(state + 1) |
+                   static_cast<uint64_t>(readU32(state + 5)) << 32;
+    readArray(state + 9, trace.previousValues);
+    const uint8_t* unchangedFrames = state + 9 + TRACE_ARRAY_SIZE;
+    const uint8_t* noise = unchangedFrames + CHESSBOARD_ROWS * CHESSBOARD_COLS;
+    for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+      for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+        const uint8_t i = row * CHESSBOARD_COLS + col;
+        trace.health[row][col].unchangedFrames = unchangedFrames[i];
+        trace.health[row][col].noise = readU16(noise + i * sizeof(uint16_t));
+      }
+    }
+  }
+  pos += headerSize;
+
+  while (pos + TRACE_FRAME_SIZE <= data.size() &&
+         data[pos] == TRACE_FRAME_TAG) {
+    trace.timestamps.push_back(readU32(&data[pos + 1]));
+    const uint8_t* p = &data[pos + 1 + sizeof(uint32_t)];
+    for (uint8_t i = 0; i < CHESSBOARD_ROWS * CHESSBOARD_COLS; i++) {
+      trace.values.push_back(readU16(p + i * sizeof(uint16_t)));
+    }
+    pos += TRACE_FRAME_SIZE;
+  }
+  if (pos < data.size()) {
+    fprintf(stderr, "Ignoring %zu trailing bytes after the last frame\n",
+            data.size() - pos);
+  }
+  if (version < 3 && !trace.timestamps.empty()) {
+    // The frame before the first wasn't recorded, so the first frame doesn't
+    // count as a change for the sensor health
+    memcpy(trace.previousValues, &trace.values[0],
+           sizeof(trace.previousValues));
+  }
+  return true;
+}
+
+struct ReplaySettings {
+  uint8_t detectionMethod;
+  bool crosstalkCompensation;
+  bool maskUnhealthySquares;
+};
+
+struct ReplayState {
+  uint64_t pieces;
+  SensorHealth health[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  uint8_t confidence[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+};
+
+static void replayStart(const Trace& trace, ReplayState& state) {
+  state.pieces = trace.pieces;
+  memcpy(state.health, trace.health, sizeof(state.health));
+}
+
+static const uint16_t (*frameValues(const Trace& trace,
+                                    size_t frame))[CHESSBOARD_COLS] {
+  return reinterpret_cast<const uint16_t(*)[CHESSBOARD_COLS]>(
+    &trace.values[frame * CHESSBOARD_ROWS * CHESSBOARD_COLS]);
+}
+
+// Same steps as taskDetect() and linearHallsUpdatePieces() in the firmware
+static void replayFrame(const Trace& trace, size_t frame,
+                        const ReplaySettings& settings, ReplayState& state) {
+  const auto* values = frameValues(trace, frame);
+  const auto* previousValues =
+    frame == 0 ? trace.previousValues : frameValues(trace, frame - 1);
+  const uint64_t unhealthySquares = healthUpdate(
+    values, previousValues, trace.presentValues, trace.emptyValues,
+    trace.presentMargins, trace.emptyMargins, state.health);
+  const uint64_t previousPieces = state.pieces;
+  state.pieces = detectionUpdatePieces(
+    values, trace.presentValues, trace.emptyValues, trace.presentMargins,
+    trace.emptyMargins, trace.likelihoods,
+    settings.crosstalkCompensation ? trace.crosstalk : nullptr, previousPieces,
+    settings.detectionMethod, state.confidence);
+  if (settings.maskUnhealthySquares) {
+    state.pieces = (state.pieces & ~unhealthySquares) |
+                   (previousPieces & unhealthySquares);
+  }
+}
+
+static void printChange(size_t frame, uint32_t timestamp, uint64_t before,
+                        uint64_t after) {
+  printf("Frame %zu (%u ms): board changed:", frame, timestamp);
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      const uint64_t bit = 1ULL << (row * CHESSBOARD_COLS + col);
+      if ((before ^ after) & bit) {
+        printf(" %c%u,%u", after & bit ? '+' : '-', row, col);
+      }
+    }
+  }
+  printf("\n");
+}
+
+static void printBitboard(uint64_t bitboard) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      const bool isPresent = bitboard & (1ULL << (row * CHESSBOARD_COLS + col));
+      printf(isPresent ? "0 " : ". ");
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  int method = -1;
+  int crosstalk = -1;
+  int mask = -1;
+  size_t settle = 3;
+  size_t repeat = 100;
+  bool quiet = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--method") == 0 && i + 1 < argc) {
+      method = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--crosstalk") == 0 && i + 1 < argc) {
+      crosstalk = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mask") == 0 && i + 1 < argc) {
+      mask = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--settle") == 0 && i + 1 < argc) {
+      settle = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--quiet") == 0) {
+      quiet = true;
+    } else if (path == nullptr && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (path == nullptr) {
+    fprintf(stderr, "Usage: %s <trace file> [--method N] [--crosstalk N] "
+                    "[--mask N] [--settle N] [--repeat N] [--quiet]\n",
+            argv[0]);
+    return 2;
+  }
+
+  Trace trace;
+  if (!loadTrace(path, trace)) {
+    return 1;
+  }
+  const size_t frames = trace.timestamps.size();
+  ReplaySettings settings;
+  settings.detectionMethod =
+    method >= 0 ? static_cast<uint8_t>(method) : trace.detectionMethod;
+  settings.crosstalkCompensation =
+    crosstalk >= 0 ? crosstalk != 0 : trace.crosstalkCompensation;
+  settings.maskUnhealthySquares =
+    mask >= 0 ? mask != 0 : trace.maskUnhealthySquares;
+  printf("Replaying %zu frames with DETECTION_METHOD %u, "
+         "CROSSTALK_COMPENSATION %u and MASK_UNHEALTHY_SQUARES %u\n",
+         frames, settings.detectionMethod, settings.crosstalkCompensation,
+         settings.maskUnhealthySquares);
+
+  ReplayState state;
+  replayStart(trace, state);
+  struct Change {
+    size_t frame;
+    uint64_t flipped; // Squares that changed
+  };
+  std::vector<Change> changes;
+  for (size_t frame = 0; frame < frames; frame++) {
+    const uint64_t previousPieces = state.pieces;
+    replayFrame(trace, frame, settings, state);
+    if (previousPieces != state.pieces) {
+      changes.push_back({frame, previousPieces ^ state.pieces});
+      if (!quiet) {
+        printChange(frame, trace.timestamps[frame], previousPieces,
+                    state.pieces);
+      }
+    }
+  }
+  // A change is false if any of its squares flips back within settle frames,
+  // so lifting one piece and quickly placing another isn't counted
+  size_t falseChanges = 0;
+  for (size_t i = 0; i < changes.size(); i++) {
+    for (size_t j = i + 1;
+         j < changes.size() && changes[j].frame - changes[i].frame < settle;
+         j++) {
+      if (changes[i].flipped & changes[j].flipped) {
+        falseChanges++;
+        break;
+      }
+    }
+  }
+
+  // Checksum the results so the benchmark loop can't be optimized away
+  uint64_t checksum = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < repeat; r++) {
+    ReplayState benchmarkState;
+    replayStart(trace, benchmarkState);
+    for (size_t frame = 0; frame < frames; frame++) {
+      replayFrame(trace, frame, settings, benchmarkState);
+      checksum += benchmarkState.pieces ^ frame;
+    }
+  }
+  const double seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+
+  if (!quiet) {
+    printf("Final board:\n");
+    printBitboard(state.pieces);
+  }
+  printf("Frames processed: %zu\n", frames);
+  printf("Board changes: %zu\n", changes.size());
+  printf("False changes (reverted within %zu frames): %zu\n", settle,
+         falseChanges);
+  if (frames > 0 && repeat > 0 && seconds > 0) {
+    printf("Frames per second: %.0f (checksum %016llx)\n",
+           frames * repeat / seconds,
+           static_cast<unsigned long long>(checksum));
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+// Runs a simulated board (see SimulatedBoard.h) on a pseudo-terminal until
+// interrupted, for developing against the serial protocol without hardware.
+//
+// Usage: simulator [--frame-us N] [--moves-ms N] [--baud N]
+//   --frame-us N  Time between frames in microseconds. (80000)
+//   --moves-ms N  Move a random piece every N milliseconds, 0 to keep the
+//                 starting position. (0)
+//   --baud N      Baud rate to send and receive at, 0 for instant. (115200)
+
+#include "SimulatedBoard.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal(int) {
+  interrupted = 1;
+}
+
+int main(int argc, char** argv) {
+  uint32_t framePeriodUs = 80000;
+  uint32_t movePeriodMs = 0;
+  uint32_t baudRate = 115200;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frame-us") == 0 && i + 1 < argc) {
+      framePeriodUs = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--moves-ms") == 0 && i + 1 < argc) {
+      movePeriodMs = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc) {
+      baudRate = strtoul(argv[++i], nullptr, 10);
+    } else {
+      fprintf(stderr, "Usage: %s [--frame-us N] [--moves-ms N] [--baud N]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  SimulatedBoard board(framePeriodUs, baudRate);
+  // Starting position, ranks 1, 2, 7 and 8 occupied
+  uint64_t pieces = 0xFFFF00000000FFFFULL;
+  board.setPieces(pieces);
+  if (!board.start()) {
+    return 1;
+  }
+  printf("Simulated board on %s\n", board.path().c_str());
+  fflush(stdout);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  srand(1);
+  while (!interrupted) {
+    std::this_thread::sleep_for(
+      std::chrono::milliseconds(movePeriodMs == 0 ? 100 : movePeriodMs));
+    if (movePeriodMs != 0) {
+      // Move a random piece to a random empty square
+      uint8_t from, to;
+      do {
+        from = rand() % 64;
+      } while (!(pieces & (1ULL << from)));
+      do {
+        to = rand() % 64;
+      } while (pieces & (1ULL << to));
+      pieces = (pieces & ~(1ULL << from)) | (1ULL << to);
+      board.setPieces(pieces);
+    }
+  }
+  board.stop();
+  return 0;
+}
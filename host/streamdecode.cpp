@@ -0,0 +1,182 @@
+// Decodes delta-compressed telemetry (see include/Telemetry.h) captured from
+// the `stream` command, reporting how many frames were received, lost (gaps in
+// the sequence numbers) and the compression ratio. Every decoded frame is
+// encoded again and compared to the received bytes, so a mismatch points to the
+// encoder and decoder disagreeing.
+//
+// Reads a capture file, or a serial port or pseudo-terminal while streaming, in
+// which case the frames per second are reported too.
+//
+// Usage: streamdecode <capture or port> [--print] [--frames N]
+//   --print     Print the text in between frames and the last frame's values.
+//   --frames N  Stop after N frames, for reading from a port. (unlimited)
+
+#include "Telemetry.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+struct StreamStats {
+  size_t frames = 0;
+  size_t keyframes = 0;
+  size_t bytes = 0;
+  size_t lostFrames = 0;
+  size_t skippedFrames = 0; // Deltas before the first keyframe
+  size_t mismatches = 0;
+  size_t invalid = 0;
+};
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  bool print = false;
+  size_t maxFrames = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--print") == 0) {
+      print = true;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      maxFrames = strtoul(argv[++i], nullptr, 10);
+    } else if (path == nullptr && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (path == nullptr) {
+    fprintf(stderr, "Usage: %s <capture or port> [--print] [--frames N]\n",
+            argv[0]);
+    return 2;
+  }
+  const int fd = open(path, O_RDONLY | O_NOCTTY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  const bool live = isatty(fd);
+
+  StreamStats stats;
+  uint16_t values[CHESSBOARD_ROWS][CHESSBOARD_COLS] = {};
+  uint16_t previous[CHESSBOARD_ROWS][CHESSBOARD_COLS] = {};
+  bool synced = false;
+  uint8_t sequence = 0;
+  uint8_t lastSequence = 0;
+  std::chrono::steady_clock::time_point firstFrame, lastFrame;
+
+  std::vector<uint8_t> data;
+  size_t pos = 0;
+  char buffer[4096];
+  bool done = false;
+  while (!done) {
+    const ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      break;
+    }
+    data.insert(data.end(), buffer, buffer + n);
+
+    while (pos < data.size()) {
+      const uint8_t tag = data[pos];
+      if (tag != TELEMETRY_KEYFRAME_TAG && tag != TELEMETRY_DELTA_TAG) {
+        // Command output in between frames, skip to the end of the line
+        const void* newline = memchr(&data[pos], '\n', data.size() - pos);
+        if (newline == nullptr) {
+          break;
+        }
+        const size_t end = static_cast<const uint8_t*>(newline) - &data[0];
+        if (print) {
+          const size_t textEnd =
+            end > pos && data[end - 1] == '\r' ? end - 1 : end;
+          printf("%.*s\n", static_cast<int>(textEnd - pos),
+                 reinterpret_cast<const char*>(&data[pos]));
+        }
+        pos = end + 1;
+        continue;
+      }
+
+      memcpy(previous, values, sizeof(values));
+      const int16_t length =
+        telemetryDecodeFrame(&data[pos], data.size() - pos, values, sequence);
+      if (length == 0) {
+        break;
+      }
+      if (length < 0) {
+        stats.invalid++;
+        pos++;
+        continue;
+      }
+      const bool keyframe = tag == TELEMETRY_KEYFRAME_TAG;
+      if (!synced && !keyframe) {
+        // Deltas mean nothing without the keyframe they build on
+        stats.skippedFrames++;
+        pos += length;
+        continue;
+      }
+      if (synced && sequence != static_cast<uint8_t>(lastSequence + 1)) {
+        stats.lostFrames += static_cast<uint8_t>(sequence - lastSequence - 1);
+      }
+
+      uint8_t encoded[TELEMETRY_MAX_FRAME_SIZE];
+      const uint8_t encodedLength =
+        telemetryEncodeFrame(values, previous, keyframe, sequence, encoded);
+      if (encodedLength != length ||
+          memcmp(encoded, &data[pos], length) != 0) {
+        stats.mismatches++;
+      }
+
+      lastFrame = std::chrono::steady_clock::now();
+      if (!synced) {
+        firstFrame = lastFrame;
+      }
+      synced = true;
+      lastSequence = sequence;
+      stats.frames++;
+      stats.keyframes += keyframe;
+      stats.bytes += length;
+      pos += length;
+      if (maxFrames != 0 && stats.frames >= maxFrames) {
+        done = true;
+        break;
+      }
+    }
+    // Keep memory bounded when reading from a port for a long time
+    if (pos > 65536) {
+      data.erase(data.begin(), data.begin() + pos);
+      pos = 0;
+    }
+  }
+  close(fd);
+
+  if (print && stats.frames > 0) {
+    printf("Last frame:\n");
+    for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+      for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+        printf("%-5u", values[row][col]);
+      }
+      printf("\n");
+    }
+  }
+  printf("Frames decoded: %zu (%zu keyframes)\n", stats.frames,
+         stats.keyframes);
+  printf("Frames lost: %zu\n", stats.lostFrames);
+  printf("Frames skipped before the first keyframe: %zu\n",
+         stats.skippedFrames);
+  printf("Invalid frames: %zu\n", stats.invalid);
+  printf("Round-trip mismatches: %zu\n", stats.mismatches);
+  if (stats.frames > 0) {
+    printf("Bytes per frame: %.2f\n",
+           static_cast<double>(stats.bytes) / stats.frames);
+    printf("Compression ratio: %.2f\n",
+           static_cast<double>(stats.frames) * TELEMETRY_RAW_FRAME_SIZE /
+             stats.bytes);
+  }
+  const double seconds =
+    std::chrono::duration<double>(lastFrame - firstFrame).count();
+  if (live && stats.frames > 1 && seconds > 0) {
+    printf("Frames per second: %.1f\n", (stats.frames - 1) / seconds);
+  }
+  return stats.mismatches == 0 && stats.invalid == 0 ? 0 : 1;
+}
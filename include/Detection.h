@@ -0,0 +1,260 @@
+#ifndef DETECTION_H
+#define DETECTION_H
+
+#include <stdint.h>
+
+// Piece detection shared between the firmware and the host-side tools. Only
+// depends on <stdint.h> and only uses integer math so the exact same
+// classification can be replayed on a PC against recorded traces.
+
+const uint8_t CHESSBOARD_ROWS = 8;
+const uint8_t CHESSBOARD_COLS = 8;
+
+const uint8_t DETECTION_METHOD_CHECK_BOTH = 0;
+const uint8_t DETECTION_METHOD_CHECK_NOT_EMPTY = 1;
+const uint8_t DETECTION_METHOD_CHECK_PRESENT = 2;
+const uint8_t DETECTION_METHOD_CHECK_EITHER = 3;
+const uint8_t DETECTION_METHOD_LIKELIHOOD = 4;
+
+// Per-square tables for the likelihood classifier, which models the empty and
+// present readings of a square as normal distributions around the calibration
+// values with the margins as 2 standard deviations.
+struct DetectionLikelihood {
+  uint8_t emptyInvSigma;   // 256 / empty standard deviation
+  uint8_t presentInvSigma; // 256 / present standard deviation
+  int8_t logSigmaRatio;    // ln(empty sigma / present sigma) in 1/16ths
+};
+
+// log2(x) in 1/16ths for x from 1 to 255
+inline int16_t detectionLog2(uint8_t x) {
+  const static uint8_t LOG2_FRACTIONS[16] = {0, 1,  3,  4,  5,  6,  7,  8,
+                                             9, 10, 11, 12, 13, 14, 15, 15};
+  int16_t result = 4 * 16;
+  uint8_t mantissa = x;
+  while (mantissa >= 32) {
+    mantissa >>= 1;
+    result += 16;
+  }
+  while (mantissa < 16) {
+    mantissa <<= 1;
+    result -= 16;
+  }
+  return result + LOG2_FRACTIONS[mantissa - 16];
+}
+
+inline uint8_t detectionInvSigma(uint16_t margin) {
+  return margin <= 2 ? 255 : margin >= 512 ? 1 : 512 / margin;
+}
+
+// Precomputes the likelihood tables, must be called whenever the margins change.
+inline void detectionUpdateLikelihoods(
+  const uint16_t presentMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint16_t emptyMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  DetectionLikelihood likelihoods[CHESSBOARD_ROWS][CHESSBOARD_COLS]) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      DetectionLikelihood& likelihood = likelihoods[row][col];
+      likelihood.emptyInvSigma = detectionInvSigma(emptyMargins[row][col]);
+      likelihood.presentInvSigma = detectionInvSigma(presentMargins[row][col]);
+      // ln(x) = log2(x) * ln(2), ln(2) is about 177 / 256
+      likelihood.logSigmaRatio =
+        (static_cast<int32_t>(detectionLog2(likelihood.presentInvSigma) -
+                              detectionLog2(likelihood.emptyInvSigma)) *
+         177) /
+        256;
+    }
+  }
+}
+
+// |value - mean| / sigma in 1/16ths, saturating at 4095
+inline uint16_t detectionStandardDistance(uint16_t value, uint16_t mean,
+                                          uint8_t invSigma) {
+  const uint16_t distance = value > mean ? value - mean : mean - value;
+  const uint32_t z = (static_cast<uint32_t>(distance) * invSigma) >> 4;
+  return z > 4095 ? 4095 : z;
+}
+
+// ln(P(value | present) / P(value | empty)) in 1/256ths, positive if a piece is
+// more likely than not.
+inline int32_t
+detectionLogLikelihoodRatio(uint16_t value, uint16_t presentValue,
+                            uint16_t emptyValue,
+                            const DetectionLikelihood& likelihood) {
+  const int32_t emptyZ =
+    detectionStandardDistance(value, emptyValue, likelihood.emptyInvSigma);
+  const int32_t presentZ =
+    detectionStandardDistance(value, presentValue, likelihood.presentInvSigma);
+  return static_cast<int32_t>(likelihood.logSigmaRatio) * 16 +
+         (emptyZ * emptyZ - presentZ * presentZ) / 2;
+}
+
+// Crosstalk coefficients of a square are how much of its shift from its empty
+// value bleeds into its orthogonal (low nibble) and diagonal (high nibble)
+// neighbours, as signed 4-bit multiples of 1/64. (-8/64 to 7/64)
+const uint8_t DETECTION_CROSSTALK_SHIFT = 6;
+const int8_t DETECTION_CROSSTALK_MIN = -8;
+const int8_t DETECTION_CROSSTALK_MAX = 7;
+
+inline uint8_t detectionPackCrosstalk(int8_t orthogonal, int8_t diagonal) {
+  return (orthogonal & 0x0F) | ((diagonal & 0x0F) << 4);
+}
+
+inline int8_t detectionCrosstalkOrthogonal(uint8_t packed) {
+  return static_cast<int8_t>(packed << 4) >> 4;
+}
+
+inline int8_t detectionCrosstalkDiagonal(uint8_t packed) {
+  return static_cast<int8_t>(packed) >> 4;
+}
+
+// Splits a bitboard into a byte per row, as variable 64-bit shifts are slow on
+// the AVR
+inline void detectionBitboardRows(uint64_t bitboard,
+                                  uint8_t rows[CHESSBOARD_ROWS]) {
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    rows[row] = bitboard & 0xFF;
+    bitboard >>= CHESSBOARD_COLS;
+  }
+}
+
+// The value of a square with the crosstalk from occupied neighbours removed.
+// The bleed is scaled by how far each neighbour currently reads from its empty
+// value, so a neighbour that was just emptied contributes (almost) nothing.
+//
+// A shift times a coefficient is at most 1023 * 8, so the 4 orthogonal and the
+// 4 diagonal neighbours are each summed in 16 bits (at most 32736) and only
+// the two sums are added in 32 bits, keeping the multiplies 16-bit on the AVR.
+inline uint16_t detectionCompensatedValue(
+  const uint16_t values[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint16_t emptyValues[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint8_t crosstalk[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint8_t occupiedRows[CHESSBOARD_ROWS], uint8_t row, uint8_t col) {
+  int16_t orthogonalBleed = 0;
+  int16_t diagonalBleed = 0;
+  for (int8_t dRow = -1; dRow <= 1; dRow++) {
+    for (int8_t dCol = -1; dCol <= 1; dCol++) {
+      const int8_t r = row + dRow;
+      const int8_t c = col + dCol;
+      if ((dRow == 0 && dCol == 0) || r < 0 || r >= CHESSBOARD_ROWS || c < 0 ||
+          c >= CHESSBOARD_COLS || !(occupiedRows[r] & (1 << c))) {
+        continue;
+      }
+      const int16_t shift = static_cast<int16_t>(values[r][c]) -
+                            static_cast<int16_t>(emptyValues[r][c]);
+      if (dRow == 0 || dCol == 0) {
+        orthogonalBleed +=
+          shift * detectionCrosstalkOrthogonal(crosstalk[r][c]);
+      } else {
+        diagonalBleed += shift * detectionCrosstalkDiagonal(crosstalk[r][c]);
+      }
+    }
+  }
+  // At most 1023 either way, so the result fits in 16 bits
+  const int16_t bleed =
+    (static_cast<int32_t>(orthogonalBleed) + diagonalBleed) /
+    (1 << DETECTION_CROSSTALK_SHIFT);
+  const int16_t value = static_cast<int16_t>(values[row][col]) - bleed;
+  return value < 0 ? 0 : value > 1023 ? 1023 : value;
+}
+
+// Classifies every square of a frame of linear hall values against the
+// calibration values and margins and returns the resulting bitboard. (bit
+// row * CHESSBOARD_COLS + col is set if a piece is on that square)
+//
+// If crosstalk is not null, the crosstalk from the squares occupied in
+// previousPieces is removed from each value first.
+//
+// confidence is filled with how sure the likelihood model is of the state
+// reported for each square, in 1/32 nat steps of the log-likelihood ratio
+// (255 is about 3000:1 odds or better) or 0 if the likelihood model disagrees
+// with the reported state.
+inline uint64_t detectionUpdatePieces(
+  const uint16_t values[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint16_t presentValues[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint16_t emptyValues[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint16_t presentMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint16_t emptyMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const DetectionLikelihood likelihoods[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  const uint8_t crosstalk[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+  uint64_t previousPieces, uint8_t detectionMethod,
+  uint8_t confidence[CHESSBOARD_ROWS][CHESSBOARD_COLS]) {
+  uint64_t pieces = 0;
+  uint8_t occupiedRows[CHESSBOARD_ROWS];
+  detectionBitboardRows(previousPieces, occupiedRows);
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      const uint16_t currentValue =
+        crosstalk == nullptr
+          ? values[row][col]
+          : detectionCompensatedValue(values, emptyValues, crosstalk,
+                                      occupiedRows, row, col);
+      const uint16_t presentValue = presentValues[row][col];
+      const uint16_t emptyValue = emptyValues[row][col];
+      const uint16_t presentMargin = presentMargins[row][col];
+      const uint16_t emptyMargin = emptyMargins[row][col];
+      const uint16_t minPresentValue = presentValue - presentMargin;
+      const uint16_t maxPresentValue = presentValue + presentMargin;
+      const uint16_t minEmptyValue = emptyValue - emptyMargin;
+      const uint16_t maxEmptyValue = emptyValue + emptyMargin;
+      const bool isEmpty =
+        minEmptyValue <= currentValue && currentValue <= maxEmptyValue;
+      const bool isPresent =
+        minPresentValue <= currentValue && currentValue <= maxPresentValue;
+      const int32_t logLikelihoodRatio = detectionLogLikelihoodRatio(
+        currentValue, presentValue, emptyValue, likelihoods[row][col]);
+      const bool isLikelyPresent = logLikelihoodRatio > 0;
+      bool occupied;
+      if (detectionMethod == DETECTION_METHOD_CHECK_BOTH) {
+        occupied = isEmpty && isPresent;
+      } else if (detectionMethod == DETECTION_METHOD_CHECK_NOT_EMPTY) {
+        occupied = !isEmpty;
+      } else if (detectionMethod == DETECTION_METHOD_CHECK_PRESENT) {
+        occupied = isPresent;
+      } else if (detectionMethod == DETECTION_METHOD_LIKELIHOOD) {
+        occupied = isLikelyPresent;
+      } else /*if (detectionMethod == DETECTION_METHOD_CHECK_EITHER)*/ {
+        occupied = !isEmpty || isPresent;
+      }
+      if (occupied) {
+        pieces |= (1ULL << (row * CHESSBOARD_COLS + col));
+      }
+      if (occupied == isLikelyPresent) {
+        const uint32_t magnitude =
+          (logLikelihoodRatio < 0 ? -logLikelihoodRatio : logLikelihoodRatio) /
+          8;
+        confidence[row][col] = magnitude > 255 ? 255 : magnitude;
+      } else {
+        confidence[row][col] = 0;
+      }
+    }
+  }
+  return pieces;
+}
+
+// Symbol showing where a value falls relative to the calibration of a square:
+//                    Number line
+// <-------[---empty---]-------[---present---]------->
+//     -         .         ?          0          X
+inline char detectionDebugSymbol(uint16_t currentValue, uint16_t presentValue,
+                                 uint16_t emptyValue, uint16_t presentMargin,
+                                 uint16_t emptyMargin) {
+  const uint16_t minPresentValue = presentValue - presentMargin;
+  const uint16_t maxPresentValue = presentValue + presentMargin;
+  const uint16_t minEmptyValue = emptyValue - emptyMargin;
+  const uint16_t maxEmptyValue = emptyValue + emptyMargin;
+  if (currentValue < minEmptyValue) {
+    return '-';
+  } else if (minEmptyValue <= currentValue && currentValue <= maxEmptyValue) {
+    return '.';
+  } else if (maxEmptyValue < currentValue && currentValue < minPresentValue) {
+    return '?';
+  } else if (minPresentValue <= currentValue &&
+             currentValue <= maxPresentValue) {
+    return '0';
+  } else if (maxPresentValue < currentValue) {
+    return 'X';
+  }
+  return ' ';
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef FAST_PINS_H
+#define FAST_PINS_H
+
+#include <Arduino.h>
+#include <util/atomic.h>
+
+// Compile-time mapping of Arduino Nano (ATmega328P) pin numbers to their port
+// registers and bit masks, so pins can be written with a single port access
+// instead of going through the digitalWrite() lookup tables.
+//
+// Pins 0 - 7 are PORTD, 8 - 13 are PORTB and 14 - 19 (A0 - A5) are PORTC. A6 and
+// A7 are analog input only and have no port.
+
+#if !defined(__AVR_ATmega328P__)
+  #error "FastPins.h only knows the ATmega328P pinout"
+#endif
+
+const uint8_t FAST_PORT_B = 0;
+const uint8_t FAST_PORT_C = 1;
+const uint8_t FAST_PORT_D = 2;
+
+constexpr uint8_t fastPinPort(uint8_t pin) {
+  return pin < 8 ? FAST_PORT_D : pin < 14 ? FAST_PORT_B : FAST_PORT_C;
+}
+
+constexpr uint8_t fastPinMask(uint8_t pin) {
+  return 1 << (pin < 8 ? pin : pin < 14 ? pin - 8 : pin - 14);
+}
+
+template <uint8_t port> struct FastPort;
+
+template <> struct FastPort<FAST_PORT_B> {
+  static volatile uint8_t& out() {
+    return PORTB;
+  }
+};
+
+template <> struct FastPort<FAST_PORT_C> {
+  static volatile uint8_t& out() {
+    return PORTC;
+  }
+};
+
+template <> struct FastPort<FAST_PORT_D> {
+  static volatile uint8_t& out() {
+    return PORTD;
+  }
+};
+
+// Sets the pins in mask on the port to the matching bits in bits with one
+// write, so all of them change at the same time. The read-modify-write runs
+// with interrupts off, so a pin on the same port changed by an interrupt in
+// between isn't put back. (3 cycles more)
+template <uint8_t port> inline void fastPortWrite(uint8_t mask, uint8_t bits) {
+  volatile uint8_t& out = FastPort<port>::out();
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    out = (out & ~mask) | bits;
+  }
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include "Detection.h"
+#include <stdint.h>
+
+// Per-square sensor health, updated incrementally every frame from the current
+// and previous raw values. Like Detection.h it only depends on <stdint.h> and
+// integer math.
+//
+// A square is suspect when its sensor:
+//   - is railed: reads within HEALTH_RAIL_MARGIN of 0 or 1023 while neither
+//     calibration value is near that rail, like a dead sensor or an open
+//     expander channel
+//   - is stuck: hasn't changed by a single step for HEALTH_STUCK_FRAMES frames,
+//     which real sensors never manage because of ADC noise
+//   - is noisy: the average change between frames is more than its larger
+//     calibration margin. With the margins as 2 standard deviations a healthy
+//     sensor averages about 0.56 margins, so this trips at about 1.8 times the
+//     calibrated noise. Changes count for at most HEALTH_NOISE_CLAMP margins,
+//     so a piece placed or removed (one big change) can't trip it on its own.
+//     The average is kept in 1/64 steps and rounded to nearest, so it settles
+//     within 1/8 of a step of the true average for any margin, and can't
+//     saturate as a change is at most 1023.
+
+const uint8_t HEALTH_RAILED = 1 << 0;
+const uint8_t HEALTH_STUCK = 1 << 1;
+const uint8_t HEALTH_NOISY = 1 << 2;
+
+const uint16_t HEALTH_RAIL_MARGIN = 3;
+const uint16_t HEALTH_RAIL_HIGH = 1023;
+const uint8_t HEALTH_STUCK_FRAMES = 255;
+// The noise average moves 1/16th of the way to every new change
+const uint8_t HEALTH_NOISE_SHIFT = 4;
+// Units of SensorHealth::noise per step, 1023 steps still fit in 16 bits
+const uint8_t HEALTH_NOISE_SCALE = 64;
+// Largest change counted in the noise average, in noise limits. A single
+// change adds at most this / 16 limits to the average.
+const uint8_t HEALTH_NOISE_CLAMP = 2;
+
+struct SensorHealth {
+  uint8_t unchangedFrames; // Saturates at HEALTH_STUCK_FRAMES
+  // Average change between frames in 1/HEALTH_NOISE_SCALE steps, at most
+  // 1023 * HEALTH_NOISE_SCALE
+  uint16_t noise;
+};
+
+// The average change above which a square is noisy, 0 when uncalibrated
+inline uint16_t healthNoiseLimit(uint16_t presentMargin, uint16_t emptyMargin) {
+  return presentMargin > emptyMargin ? presentMargin : emptyMargin;
+}
+
+// Returns the HEALTH_* flags of a square.
+inline uint8_t healthFlags(uint16_t value, uint16_t presentValue,
+                           uint16_t emptyValue, uint16_t presentMargin,
+                           uint16_t emptyMargin, const SensorHealth& health) {
+  uint8_t flags = 0;
+  const uint16_t calibratedLow =
+    presentValue < emptyValue ? presentValue : emptyValue;
+  const uint16_t calibratedHigh =
+    presentValue > emptyValue ? presentValue : emptyValue;
+  if ((value <= HEALTH_RAIL_MARGIN && calibratedLow > HEALTH_RAIL_MARGIN) ||
+      (value >= HEALTH_RAIL_HIGH - HEALTH_RAIL_MARGIN &&
+       calibratedHigh < HEALTH_RAIL_HIGH - HEALTH_RAIL_MARGIN)) {
+    flags |= HEALTH_RAILED;
+  }
+  if (health.unchangedFrames >= HEALTH_STUCK_FRAMES) {
+    flags |= HEALTH_STUCK;
+  }
+  const uint16_t noiseLimit = healthNoiseLimit(presentMargin, emptyMargin);
+  if (noiseLimit != 0 &&
+      health.noise > static_cast<uint32_t>(noiseLimit) * HEALTH_NOISE_SCALE) {
+    flags |= HEALTH_NOISY;
+  }
+  return flags;
+}
+
+// Updates the health of every square with a new frame, returns a bitboard of
+// the suspect squares.
+inline uint64_t
+healthUpdate(const uint16_t values[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+             const uint16_t previous[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+             const uint16_t presentValues[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+             const uint16_t emptyValues[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+             const uint16_t presentMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+             const uint16_t emptyMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+             SensorHealth health[CHESSBOARD_ROWS][CHESSBOARD_COLS]) {
+  uint64_t suspect = 0;
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    uint8_t suspectCols = 0;
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      SensorHealth& square = health[row][col];
+      uint16_t change = values[row][col] > previous[row][col]
+                          ? values[row][col] - previous[row][col]
+                          : previous[row][col] - values[row][col];
+      if (change == 0) {
+        if (square.unchangedFrames < HEALTH_STUCK_FRAMES) {
+          square.unchangedFrames++;
+        }
+      } else {
+        square.unchangedFrames = 0;
+      }
+      const uint16_t noiseLimit =
+        healthNoiseLimit(presentMargins[row][col], emptyMargins[row][col]);
+      if (noiseLimit != 0 && change > noiseLimit * HEALTH_NOISE_CLAMP) {
+        change = noiseLimit * HEALTH_NOISE_CLAMP;
+      }
+      // Moves the average change 1/16th of the way to this change, with the
+      // subtraction rounded to nearest so the average isn't biased either way
+      square.noise = square.noise +
+                     change * (HEALTH_NOISE_SCALE >> HEALTH_NOISE_SHIFT) -
+                     ((square.noise + (1 << (HEALTH_NOISE_SHIFT - 1))) >>
+                      HEALTH_NOISE_SHIFT);
+      if (healthFlags(values[row][col], presentValues[row][col],
+                      emptyValues[row][col], presentMargins[row][col],
+                      emptyMargins[row][col], square) != 0) {
+        suspectCols |= 1 << col;
+      }
+    }
+    suspect |= static_cast<uint64_t>(suspectCols) << (row * CHESSBOARD_COLS);
+  }
+  return suspect;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+
+// Cooperative scheduler for the main loop. Tasks run to completion and are
+// listed in priority order, highest first. Every pass runs the highest priority
+// task that is ready, then starts over from the top, so a task waits at most
+// for the longest run of any other single task. Nothing limits how long a run
+// takes, keeping runs short is up to the tasks.
+//
+// A task with a period is ready once that long has passed since it last
+// started. A task without a period is only ready after schedulerTrigger().
+// Starting more than the deadline after becoming ready counts as a deadline
+// miss, running longer than the budget counts as a budget overrun.
+
+struct Task {
+  const char* name; // PROGMEM
+  void (*run)();
+  uint16_t periodUs;   // 0 to only run when triggered
+  uint16_t deadlineUs; // Longest wait from ready to started
+  uint16_t budgetUs;   // Longest expected run
+
+  Task(const char* name, void (*run)(), uint16_t periodUs, uint16_t deadlineUs,
+       uint16_t budgetUs)
+      : name(name), run(run), periodUs(periodUs), deadlineUs(deadlineUs),
+        budgetUs(budgetUs), triggered(false), readyTime(0), runs(0),
+        totalRuntimeMs(0), totalRuntimeRemainderUs(0), maxRuntimeUs(0),
+        deadlineMisses(0),
+        budgetOverruns(0) {
+  }
+
+  bool triggered;
+  uint32_t readyTime;
+  uint32_t runs;
+  // In ms and the us left over, as a uint32_t of us wraps after 71 minutes
+  uint32_t totalRuntimeMs;
+  uint16_t totalRuntimeRemainderUs;
+  uint16_t maxRuntimeUs;
+  uint16_t deadlineMisses;
+  uint16_t budgetOverruns;
+};
+
+struct SchedulerStats {
+  uint32_t startTime; // millis() when the statistics were reset
+  uint32_t passes;
+  uint32_t idlePasses;
+  // Time spent picking tasks and keeping statistics, not running tasks, in ms
+  // and the us left over
+  uint32_t overheadMs;
+  uint16_t overheadRemainderUs;
+};
+
+// Adds us to a total kept in ms and the us left over, which doesn't wrap for
+// 49 days
+inline void schedulerAddTime(uint32_t& totalMs, uint16_t& remainderUs,
+                             uint32_t us) {
+  us += remainderUs;
+  totalMs += us / 1000;
+  remainderUs = us % 1000;
+}
+
+inline void schedulerTrigger(Task& task) {
+  if (!task.triggered) {
+    task.triggered = true;
+    task.readyTime = micros();
+  }
+}
+
+inline void schedulerResetStats(Task* tasks, uint8_t count,
+                                SchedulerStats& stats) {
+  for (uint8_t i = 0; i < count; i++) {
+    tasks[i].runs = 0;
+    tasks[i].totalRuntimeMs = 0;
+    tasks[i].totalRuntimeRemainderUs = 0;
+    tasks[i].maxRuntimeUs = 0;
+    tasks[i].deadlineMisses = 0;
+    tasks[i].budgetOverruns = 0;
+  }
+  stats.startTime = millis();
+  stats.passes = 0;
+  stats.idlePasses = 0;
+  stats.overheadMs = 0;
+  stats.overheadRemainderUs = 0;
+}
+
+// Call once before the first schedulerRun(), so periodic tasks aren't late
+// from the start. Periodic tasks first run one period from now, like they
+// would after a run, so the scan task gets the settle time after the column
+// selected in setup().
+inline void schedulerBegin(Task* tasks, uint8_t count, SchedulerStats& stats) {
+  const uint32_t now = micros();
+  for (uint8_t i = 0; i < count; i++) {
+    tasks[i].triggered = false;
+    tasks[i].readyTime = now + tasks[i].periodUs;
+  }
+  schedulerResetStats(tasks, count, stats);
+}
+
+// Runs the highest priority task that is ready, if any.
+inline void schedulerRun(Task* tasks, uint8_t count, SchedulerStats& stats) {
+  const uint32_t passStart = micros();
+  stats.passes++;
+  for (uint8_t i = 0; i < count; i++) {
+    Task& task = tasks[i];
+    const uint32_t waited = passStart - task.readyTime;
+    // Wraps around to a huge value while a periodic task isn't ready yet
+    const bool ready =
+      task.periodUs == 0 ? task.triggered : waited < 0x80000000UL;
+    if (!ready) {
+      continue;
+    }
+    if (waited > task.deadlineUs && task.deadlineMisses < UINT16_MAX) {
+      task.deadlineMisses++;
+    }
+    task.triggered = false;
+
+    const uint32_t taskStart = micros();
+    task.run();
+    const uint32_t taskEnd = micros();
+    const uint32_t runtime = taskEnd - taskStart;
+
+    if (task.periodUs != 0) {
+      task.readyTime = taskStart + task.periodUs;
+    }
+    task.runs++;
+    schedulerAddTime(task.totalRuntimeMs, task.totalRuntimeRemainderUs,
+                     runtime);
+    if (runtime > task.maxRuntimeUs) {
+      task.maxRuntimeUs = runtime < UINT16_MAX ? runtime : UINT16_MAX;
+    }
+    if (runtime > task.budgetUs && task.budgetOverruns < UINT16_MAX) {
+      task.budgetOverruns++;
+    }
+    schedulerAddTime(stats.overheadMs, stats.overheadRemainderUs,
+                     micros() - passStart - runtime);
+    return;
+  }
+  stats.idlePasses++;
+}
+
+#endif
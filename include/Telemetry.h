@@ -0,0 +1,183 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "Detection.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Delta-compressed raw telemetry, written by the `stream` command. Every frame
+// scanned is sent, either as a keyframe or as the changes from the previous
+// frame, so a quiet board only costs a few bytes per frame.
+//
+// Keyframe (TELEMETRY_KEYFRAME_SIZE bytes):
+//   uint8_t tag               TELEMETRY_KEYFRAME_TAG
+//   uint8_t sequence          Incremented every frame, wraps around
+//   uint8_t lowBytes[64]      Low 8 bits of every value in row-major order
+//   uint8_t highBits[16]      Top 2 bits of every value, 4 values per byte
+//                             starting from the least significant bits
+//
+// Delta frame (3 to TELEMETRY_MAX_FRAME_SIZE bytes):
+//   uint8_t tag               TELEMETRY_DELTA_TAG
+//   uint8_t sequence
+//   uint8_t changedRows       Bit per row with at least one changed square
+//   uint8_t changedCols[n]    Bit per changed square, for each changed row
+//   varint  deltas[m]         Zig-zag encoded change of each changed square,
+//                             7 bits per byte with the top bit set on all but
+//                             the last byte
+//
+// The tags are never printable characters, so text printed by commands in
+// between frames can be skipped by reading up to the end of the line.
+
+const uint8_t TELEMETRY_KEYFRAME_TAG = 0xFC;
+const uint8_t TELEMETRY_DELTA_TAG = 0xFD;
+
+const uint8_t TELEMETRY_SQUARES = CHESSBOARD_ROWS * CHESSBOARD_COLS;
+const uint8_t TELEMETRY_KEYFRAME_SIZE = 2 + TELEMETRY_SQUARES * 5 / 4;
+// Deltas of values up to 1023 take at most 2 varint bytes
+const uint8_t TELEMETRY_MAX_FRAME_SIZE =
+  3 + CHESSBOARD_ROWS + TELEMETRY_SQUARES * 2;
+// What a frame costs without compression, for the compression ratio
+const uint8_t TELEMETRY_RAW_FRAME_SIZE = TELEMETRY_SQUARES * sizeof(uint16_t);
+
+inline uint16_t telemetryZigZag(int16_t value) {
+  return (static_cast<uint16_t>(value) << 1) ^ (value < 0 ? 0xFFFF : 0);
+}
+
+inline int16_t telemetryUnZigZag(uint16_t value) {
+  return static_cast<int16_t>(value >> 1) ^ -static_cast<int16_t>(value & 1);
+}
+
+// Encodes a frame into out, returns the number of bytes written.
+inline uint8_t
+telemetryEncodeFrame(const uint16_t values[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+                     const uint16_t previous[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+                     bool keyframe, uint8_t sequence,
+                     uint8_t out[TELEMETRY_MAX_FRAME_SIZE]) {
+  const uint16_t* current = &values[0][0];
+  uint8_t length = 0;
+  out[length++] = keyframe ? TELEMETRY_KEYFRAME_TAG : TELEMETRY_DELTA_TAG;
+  out[length++] = sequence;
+  if (keyframe) {
+    for (uint8_t i = 0; i < TELEMETRY_SQUARES; i++) {
+      out[length++] = current[i] & 0xFF;
+    }
+    for (uint8_t i = 0; i < TELEMETRY_SQUARES; i += 4) {
+      uint8_t highBits = 0;
+      for (uint8_t j = 0; j < 4; j++) {
+        highBits |= ((current[i + j] >> 8) & 0b11) << (j * 2);
+      }
+      out[length++] = highBits;
+    }
+    return length;
+  }
+
+  const uint8_t changedRowsIndex = length++;
+  out[changedRowsIndex] = 0;
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    uint8_t changedCols = 0;
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      if (values[row][col] != previous[row][col]) {
+        changedCols |= 1 << col;
+      }
+    }
+    if (changedCols != 0) {
+      out[changedRowsIndex] |= 1 << row;
+      out[length++] = changedCols;
+    }
+  }
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      if (values[row][col] == previous[row][col]) {
+        continue;
+      }
+      uint16_t zigZag = telemetryZigZag(values[row][col] - previous[row][col]);
+      while (zigZag >= 0x80) {
+        out[length++] = (zigZag & 0x7F) | 0x80;
+        zigZag >>= 7;
+      }
+      out[length++] = zigZag;
+    }
+  }
+  return length;
+}
+
+// Decodes a frame starting with its tag, updating values in place. Returns the
+// number of bytes used, 0 if more bytes are needed or -1 if data does not
+// start with a valid frame.
+inline int16_t
+telemetryDecodeFrame(const uint8_t* data, size_t length,
+                     uint16_t values[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+                     uint8_t& sequence) {
+  if (length < 3) {
+    return length == 0 || data[0] == TELEMETRY_KEYFRAME_TAG ||
+               data[0] == TELEMETRY_DELTA_TAG
+             ? 0
+             : -1;
+  }
+  uint16_t* current = &values[0][0];
+  if (data[0] == TELEMETRY_KEYFRAME_TAG) {
+    if (length < TELEMETRY_KEYFRAME_SIZE) {
+      return 0;
+    }
+    sequence = data[1];
+    const uint8_t* lowBytes = data + 2;
+    const uint8_t* highBits = lowBytes + TELEMETRY_SQUARES;
+    for (uint8_t i = 0; i < TELEMETRY_SQUARES; i++) {
+      current[i] =
+        lowBytes[i] | (((highBits[i / 4] >> ((i % 4) * 2)) & 0b11) << 8);
+    }
+    return TELEMETRY_KEYFRAME_SIZE;
+  }
+  if (data[0] != TELEMETRY_DELTA_TAG) {
+    return -1;
+  }
+
+  const uint8_t changedRows = data[2];
+  size_t pos = 3;
+  uint8_t changedCols[CHESSBOARD_ROWS];
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    changedCols[row] = 0;
+    if (changedRows & (1 << row)) {
+      if (pos >= length) {
+        return 0;
+      }
+      changedCols[row] = data[pos++];
+    }
+  }
+  // Decode into a copy so a partial frame leaves values untouched
+  uint16_t decoded[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      decoded[row][col] = values[row][col];
+      if (!(changedCols[row] & (1 << col))) {
+        continue;
+      }
+      uint16_t zigZag = 0;
+      uint8_t shift = 0;
+      while (true) {
+        if (pos >= length) {
+          return 0;
+        }
+        if (shift > 14) {
+          return -1;
+        }
+        const uint8_t byte = data[pos++];
+        zigZag |= static_cast<uint16_t>(byte & 0x7F) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) {
+          break;
+        }
+      }
+      decoded[row][col] += telemetryUnZigZag(zigZag);
+    }
+  }
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      values[row][col] = decoded[row][col];
+    }
+  }
+  sequence = data[1];
+  return pos;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "Detection.h"
+#include <stdint.h>
+
+// Raw-frame trace format, written by the `trace` command and read by the
+// host-side replay tool. All multi-byte values are little-endian (native on the
+// ATmega328P) so the firmware can write its arrays out directly.
+//
+// Header (TRACE_HEADER_SIZE bytes):
+//   char     magic[4]           "CBTR"
+//   uint8_t  version            TRACE_VERSION
+//   uint8_t  rows, cols         CHESSBOARD_ROWS, CHESSBOARD_COLS
+//   uint8_t  detectionMethod    DETECTION_METHOD setting at trace start
+//   uint16_t presentValues[rows][cols]
+//   uint16_t emptyValues[rows][cols]
+//   uint16_t presentMargins[rows][cols]
+//   uint16_t emptyMargins[rows][cols]
+//   uint8_t  crosstalkCompensation  CROSSTALK_COMPENSATION setting (version 2+)
+//   uint8_t  crosstalk[rows][cols]  Packed coefficients, see Detection.h (2+)
+//   uint8_t  maskUnhealthySquares   MASK_UNHEALTHY_SQUARES setting (3+)
+//   uint64_t pieces                 Bitboard before the first frame (3+)
+//   uint16_t previousValues[rows][cols]  Raw values of the frame before the
+//                                        first, for the sensor health (3+)
+//   uint8_t  unchangedFrames[rows][cols] SensorHealth before the first frame,
+//   uint16_t noise[rows][cols]           see Health.h (3+)
+//
+// Version 3 headers are written just before the first frame, so they hold the
+// exact state that frame builds on. Readers of older versions start from an
+// empty board and no sensor health history.
+//
+// Followed by any number of frames (TRACE_FRAME_SIZE bytes each):
+//   uint8_t  tag                TRACE_FRAME_TAG
+//   uint32_t timestamp          millis() when the frame finished scanning
+//   uint16_t values[rows][cols] Raw linear hall values
+//
+// The frame tag is never a printable character, so a reader stops cleanly at
+// any text the firmware prints after the last frame.
+
+const char TRACE_MAGIC[4] = {'C', 'B', 'T', 'R'};
+const uint8_t TRACE_VERSION = 3;
+const uint8_t TRACE_FRAME_TAG = 0xFE;
+
+const uint16_t TRACE_ARRAY_SIZE =
+  CHESSBOARD_ROWS * CHESSBOARD_COLS * sizeof(uint16_t);
+const uint16_t TRACE_HEADER_V1_SIZE =
+  sizeof(TRACE_MAGIC) + 4 + 4 * TRACE_ARRAY_SIZE;
+const uint16_t TRACE_HEADER_V2_SIZE =
+  TRACE_HEADER_V1_SIZE + 1 + CHESSBOARD_ROWS * CHESSBOARD_COLS;
+const uint16_t TRACE_HEADER_SIZE = TRACE_HEADER_V2_SIZE + 1 +
+                                   sizeof(uint64_t) + TRACE_ARRAY_SIZE +
+                                   CHESSBOARD_ROWS * CHESSBOARD_COLS +
+                                   TRACE_ARRAY_SIZE;
+const uint16_t TRACE_FRAME_SIZE = 1 + sizeof(uint32_t) + TRACE_ARRAY_SIZE;
+
+#endif
@@ -2,24 +2,69 @@
 #include <EEPROM.h>
 #include <SerialCommands.h>
 
-const uint8_t CHESSBOARD_ROWS = 8;
-const uint8_t CHESSBOARD_COLS = 8;
+#include "Detection.h"
+#include "FastPins.h"
+#include "Health.h"
+#include "Scheduler.h"
+#include "Telemetry.h"
+#include "Trace.h"
+
 uint16_t linearHallValues[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+uint16_t linearHallPreviousValues[CHESSBOARD_ROWS][CHESSBOARD_COLS];
 uint64_t previousPieces = 0;
 uint64_t pieces = 0;
-char piecesDebug[CHESSBOARD_ROWS][CHESSBOARD_COLS]; // For debugging
+uint8_t piecesConfidence[CHESSBOARD_ROWS][CHESSBOARD_COLS];
 uint16_t linearHallPresentValues[CHESSBOARD_ROWS][CHESSBOARD_COLS];
 uint16_t linearHallEmptyValues[CHESSBOARD_ROWS][CHESSBOARD_COLS];
 uint16_t linearHallPresentMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS];
 uint16_t linearHallEmptyMargins[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+// Recomputed from the margins before the next classification when invalidated
+DetectionLikelihood linearHallLikelihoods[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+bool linearHallLikelihoodsValid = false;
 
 bool autoLoadCalibration = true;
 uint8_t detectionMethod = 0;
-const uint8_t DETECTION_METHOD_CHECK_BOTH = 0;
-const uint8_t DETECTION_METHOD_CHECK_NOT_EMPTY = 1;
-const uint8_t DETECTION_METHOD_CHECK_PRESENT = 2;
-const uint8_t DETECTION_METHOD_CHECK_EITHER = 3;
 bool printOnBoardChange = false;
+// 0 is the calibration saved with calibrationSaveToEEPROM
+const uint8_t PROFILES_NUM = 3;
+uint8_t activeProfile = 0;
+bool crosstalkCompensation = false;
+bool fastBoot = false;
+// Packed per-square coefficients, see detectionPackCrosstalk
+uint8_t linearHallCrosstalk[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+SensorHealth linearHallHealth[CHESSBOARD_ROWS][CHESSBOARD_COLS];
+uint64_t unhealthySquares = 0;
+bool maskUnhealthySquares = false;
+// No frame has been detected since linearHallsBegin()
+bool linearHallsFirstFrame = true;
+
+// Last board state written to EEPROM, restored on a fast boot
+uint64_t savedPieces = 0;
+// Whether EEPROM holds a board state at all, it doesn't when erased
+bool boardStateSaved = false;
+// Whether the board state was restored on startup
+bool boardStateRestored = false;
+uint32_t piecesChangedTime = 0;
+// Board states are only saved once they have been stable for this long, so
+// lifting and placing a piece costs one EEPROM write instead of two
+const uint16_t BOARD_STATE_SAVE_DELAY = 2000;
+// Change reports are suppressed until a stable frame confirms the restored
+// board state
+bool boardStateConfirmed = true;
+uint32_t readyTime = 0;
+uint32_t boardStateConfirmedTime = 0;
+
+bool tracing = false;
+// The header is written just before the first frame
+bool traceHeaderPending = false;
+
+bool streaming = false;
+uint8_t streamKeyframeInterval = 32;
+uint8_t streamSequence = 0;
+uint32_t streamFrames = 0;
+uint32_t streamBytes = 0;
+uint32_t streamStartTime = 0;
+uint32_t streamStopTime = 0;
 
 const uint16_t arraySizeInEEPROM =
   CHESSBOARD_ROWS * CHESSBOARD_COLS * sizeof(uint16_t);
@@ -38,6 +83,33 @@ const uint16_t DETECTION_METHOD_EEPROM_START_ADDR = // 513
   AUTO_LOAD_CALIBRATION_EEPROM_START_ADDR + sizeof(autoLoadCalibration);
 const uint16_t PRINT_ON_BOARD_CHANGE_EEPROM_START_ADDR = // 514
   DETECTION_METHOD_EEPROM_START_ADDR + sizeof(detectionMethod);
+const uint16_t ACTIVE_PROFILE_EEPROM_START_ADDR = // 515
+  PRINT_ON_BOARD_CHANGE_EEPROM_START_ADDR + sizeof(printOnBoardChange);
+const uint16_t CROSSTALK_COMPENSATION_EEPROM_START_ADDR = // 516
+  ACTIVE_PROFILE_EEPROM_START_ADDR + sizeof(activeProfile);
+const uint16_t CROSSTALK_EEPROM_START_ADDR = // 517 - 580
+  CROSSTALK_COMPENSATION_EEPROM_START_ADDR + sizeof(crosstalkCompensation);
+const uint16_t FAST_BOOT_EEPROM_START_ADDR = // 581
+  CROSSTALK_EEPROM_START_ADDR + sizeof(linearHallCrosstalk);
+const uint16_t BOARD_STATE_EEPROM_START_ADDR = // 582 - 589
+  FAST_BOOT_EEPROM_START_ADDR + sizeof(fastBoot);
+const uint16_t MASK_UNHEALTHY_SQUARES_EEPROM_START_ADDR = // 590
+  BOARD_STATE_EEPROM_START_ADDR + sizeof(pieces);
+// Written after the board state, so erased EEPROM (all 0xFF, which would be
+// a full board) isn't restored
+const uint8_t BOARD_STATE_SAVED_MARKER = 0xA5;
+const uint16_t BOARD_STATE_SAVED_EEPROM_START_ADDR = // 591
+  MASK_UNHEALTHY_SQUARES_EEPROM_START_ADDR + sizeof(maskUnhealthySquares);
+
+// Profiles 1 and up only hold what depends on the piece set, the present
+// calibration values (low bytes followed by the top 2 bits packed 4 per byte)
+// and the present margins (clamped to a byte), after a saved marker
+const uint8_t PROFILE_SAVED_MARKER = 0xA5;
+const uint16_t PROFILE_SIZE_IN_EEPROM = // 145
+  1 + CHESSBOARD_ROWS * CHESSBOARD_COLS * 5 / 4 +
+  CHESSBOARD_ROWS * CHESSBOARD_COLS;
+const uint16_t PROFILES_EEPROM_START_ADDR = // 734 - 1023
+  E2END + 1 - (PROFILES_NUM - 1) * PROFILE_SIZE_IN_EEPROM;
 
 const uint8_t EXPANDERS_NUM = CHESSBOARD_ROWS;
 const uint8_t EXPANDERS_A_PIN = 2;
@@ -47,117 +119,339 @@ const uint8_t EXPANDERS_INH_PIN = 5;
 const uint8_t EXPANDER_COMS_PINS[EXPANDERS_NUM] = {A7, A6, A5, A4,
                                                    A3, A2, A1, A0};
 // Need to read expander in this order (due to wiring)
-const uint8_t EXPANDER_COLS_TO_BITS[CHESSBOARD_COLS] = {2, 1, 0, 3, 5, 7, 6, 4};
+constexpr uint8_t EXPANDER_COLS_TO_BITS[CHESSBOARD_COLS] = {2, 1, 0, 3,
+                                                            5, 7, 6, 4};
+
+// The select pins are written together with one port write so the expanders
+// never pass through an intermediate channel while switching columns
+const uint8_t EXPANDERS_SELECT_PORT = fastPinPort(EXPANDERS_A_PIN);
+static_assert(fastPinPort(EXPANDERS_B_PIN) == EXPANDERS_SELECT_PORT &&
+                fastPinPort(EXPANDERS_C_PIN) == EXPANDERS_SELECT_PORT,
+              "Expander select pins must be on the same port");
+const uint8_t EXPANDERS_SELECT_MASK = fastPinMask(EXPANDERS_A_PIN) |
+                                      fastPinMask(EXPANDERS_B_PIN) |
+                                      fastPinMask(EXPANDERS_C_PIN);
+
+constexpr uint8_t expanderSelectBits(uint8_t channel) {
+  return (channel & 0b001 ? fastPinMask(EXPANDERS_A_PIN) : 0) |
+         (channel & 0b010 ? fastPinMask(EXPANDERS_B_PIN) : 0) |
+         (channel & 0b100 ? fastPinMask(EXPANDERS_C_PIN) : 0);
+}
+
+static_assert(CHESSBOARD_COLS == 8, "Update EXPANDER_COLS_TO_SELECT_BITS");
+const uint8_t EXPANDER_COLS_TO_SELECT_BITS[CHESSBOARD_COLS] = {
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[0]),
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[1]),
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[2]),
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[3]),
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[4]),
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[5]),
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[6]),
+  expanderSelectBits(EXPANDER_COLS_TO_BITS[7])};
 
 void linearHallsBegin() {
   pinMode(EXPANDERS_A_PIN, OUTPUT);
   pinMode(EXPANDERS_B_PIN, OUTPUT);
   pinMode(EXPANDERS_C_PIN, OUTPUT);
   pinMode(EXPANDERS_INH_PIN, OUTPUT);
-  digitalWrite(EXPANDERS_A_PIN, LOW);
-  digitalWrite(EXPANDERS_B_PIN, LOW);
-  digitalWrite(EXPANDERS_C_PIN, LOW);
+  fastPortWrite<EXPANDERS_SELECT_PORT>(EXPANDERS_SELECT_MASK, 0);
   digitalWrite(EXPANDERS_INH_PIN, LOW); // Low to enable
   for (uint8_t i : EXPANDER_COMS_PINS) {
     pinMode(i, INPUT);
   }
   memset(linearHallValues, 0, sizeof(linearHallValues));
+  memset(linearHallPreviousValues, 0, sizeof(linearHallPreviousValues));
   pieces = 0;
   memset(linearHallPresentValues, 0, sizeof(linearHallPresentValues));
   memset(linearHallEmptyValues, 0, sizeof(linearHallEmptyValues));
   memset(linearHallPresentMargins, 0, sizeof(linearHallPresentMargins));
   memset(linearHallEmptyMargins, 0, sizeof(linearHallEmptyMargins));
+  memset(linearHallCrosstalk, 0, sizeof(linearHallCrosstalk));
+  memset(linearHallHealth, 0, sizeof(linearHallHealth));
+  unhealthySquares = 0;
+  linearHallsFirstFrame = true;
 }
 
-void linearHallsRead() {
-  for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
-    digitalWrite(EXPANDERS_A_PIN, EXPANDER_COLS_TO_BITS[col] & 0b001);
-    digitalWrite(EXPANDERS_B_PIN, EXPANDER_COLS_TO_BITS[col] & 0b010);
-    digitalWrite(EXPANDERS_C_PIN, EXPANDER_COLS_TO_BITS[col] & 0b100);
-    delay(10);
-    for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
-      linearHallValues[row][col] = analogRead(EXPANDER_COMS_PINS[row]);
-    }
+// Time for the expander outputs to settle after selecting a column
+const uint8_t LINEAR_HALLS_SETTLE_TIME = 10;
+uint8_t linearHallsScanColumn = 0;
+
+// Selects the first column, to be read by the next step once it has settled
+void linearHallsScanRestart() {
+  linearHallsScanColumn = 0;
+  fastPortWrite<EXPANDERS_SELECT_PORT>(EXPANDERS_SELECT_MASK,
+                                       EXPANDER_COLS_TO_SELECT_BITS[0]);
+}
+// Reads the column selected by the previous step and selects the next one,
+// returns true once a whole frame has been read. Must be at least
+// LINEAR_HALLS_SETTLE_TIME ms apart.
+bool linearHallsScanStep() {
+  const uint8_t col = linearHallsScanColumn;
+  if (col == 0) {
+    memcpy(linearHallPreviousValues, linearHallValues,
+           sizeof(linearHallValues));
   }
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    linearHallValues[row][col] = analogRead(EXPANDER_COMS_PINS[row]);
+  }
+  linearHallsScanColumn = col + 1 < CHESSBOARD_COLS ? col + 1 : 0;
+  fastPortWrite<EXPANDERS_SELECT_PORT>(
+    EXPANDERS_SELECT_MASK, EXPANDER_COLS_TO_SELECT_BITS[linearHallsScanColumn]);
+  return linearHallsScanColumn == 0;
+}
+// Reads a whole frame, blocking. Ends with the first column selected and
+// settled, so the scan task can carry on straight away.
+void linearHallsRead() {
+  linearHallsScanRestart();
+  do {
+    delay(LINEAR_HALLS_SETTLE_TIME);
+  } while (!linearHallsScanStep());
+  delay(LINEAR_HALLS_SETTLE_TIME);
 }
 
 bool linearHallsUpdatePieces() {
   previousPieces = pieces;
-  pieces = 0;
-  memset(piecesDebug, ' ', sizeof(piecesDebug));
+  if (!linearHallLikelihoodsValid) {
+    detectionUpdateLikelihoods(linearHallPresentMargins,
+                               linearHallEmptyMargins, linearHallLikelihoods);
+    linearHallLikelihoodsValid = true;
+  }
+  pieces = detectionUpdatePieces(
+    linearHallValues, linearHallPresentValues, linearHallEmptyValues,
+    linearHallPresentMargins, linearHallEmptyMargins, linearHallLikelihoods,
+    crosstalkCompensation ? linearHallCrosstalk : nullptr, previousPieces,
+    detectionMethod, piecesConfidence);
+  if (maskUnhealthySquares) {
+    // Keep the last state reported before the square became unhealthy
+    pieces = (pieces & ~unhealthySquares) | (previousPieces & unhealthySquares);
+  }
+  return previousPieces != pieces;
+}
+
+// See Trace.h for the format
+void traceWriteHeader(Stream* stream) {
+  stream->write(reinterpret_cast<const uint8_t*>(TRACE_MAGIC),
+                sizeof(TRACE_MAGIC));
+  stream->write(TRACE_VERSION);
+  stream->write(CHESSBOARD_ROWS);
+  stream->write(CHESSBOARD_COLS);
+  stream->write(detectionMethod);
+  stream->write(reinterpret_cast<const uint8_t*>(linearHallPresentValues),
+                sizeof(linearHallPresentValues));
+  stream->write(reinterpret_cast<const uint8_t*>(linearHallEmptyValues),
+                sizeof(linearHallEmptyValues));
+  stream->write(reinterpret_cast<const uint8_t*>(linearHallPresentMargins),
+                sizeof(linearHallPresentMargins));
+  stream->write(reinterpret_cast<const uint8_t*>(linearHallEmptyMargins),
+                sizeof(linearHallEmptyMargins));
+  stream->write(crosstalkCompensation);
+  stream->write(reinterpret_cast<const uint8_t*>(linearHallCrosstalk),
+                sizeof(linearHallCrosstalk));
+  stream->write(maskUnhealthySquares);
+  stream->write(reinterpret_cast<const uint8_t*>(&pieces), sizeof(pieces));
+  stream->write(reinterpret_cast<const uint8_t*>(linearHallPreviousValues),
+                sizeof(linearHallPreviousValues));
   for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
     for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
-      const uint16_t currentValue = linearHallValues[row][col];
-      const uint16_t presentValue = linearHallPresentValues[row][col];
-      const uint16_t emptyValue = linearHallEmptyValues[row][col];
-      const uint16_t presentMargin = linearHallPresentMargins[row][col];
-      const uint16_t emptyMargin = linearHallEmptyMargins[row][col];
-      const uint16_t minPresentValue = presentValue - presentMargin;
-      const uint16_t maxPresentValue = presentValue + presentMargin;
-      const uint16_t minEmptyValue = emptyValue - emptyMargin;
-      const uint16_t maxEmptyValue = emptyValue + emptyMargin;
-      const bool isEmpty =
-        minEmptyValue <= currentValue && currentValue <= maxEmptyValue;
-      const bool isPresent =
-        minPresentValue <= currentValue && currentValue <= maxPresentValue;
-#define SET_THIS_BIT pieces |= (1ULL << (row * CHESSBOARD_COLS + col));
-      if (detectionMethod == DETECTION_METHOD_CHECK_BOTH) {
-        if (isEmpty && isPresent) {
-          SET_THIS_BIT
-        }
-      } else if (detectionMethod == DETECTION_METHOD_CHECK_NOT_EMPTY) {
-        if (!isEmpty) {
-          SET_THIS_BIT
-        }
-      } else if (detectionMethod == DETECTION_METHOD_CHECK_PRESENT) {
-        if (isPresent) {
-          SET_THIS_BIT
-        }
-      } else /*if (detectionMethod == DETECTION_METHOD_CHECK_EITHER)*/ {
-        if (!isEmpty || isPresent) {
-          SET_THIS_BIT
-        }
-      }
-#undef SET_THIS_BIT
-      // For debugging values
-      //                    Number line
-      // <-------[---empty---]-------[---present---]------->
-      //     -         .         ?          0          X
-      if (currentValue < minEmptyValue) {
-        piecesDebug[row][col] = '-';
-      } else if (minEmptyValue <= currentValue &&
-                 currentValue <= maxEmptyValue) {
-        piecesDebug[row][col] = '.';
-      } else if (maxEmptyValue < currentValue &&
-                 currentValue < minPresentValue) {
-        piecesDebug[row][col] = '?';
-      } else if (minPresentValue <= currentValue &&
-                 currentValue <= maxPresentValue) {
-        piecesDebug[row][col] = '0';
-      } else if (maxPresentValue < currentValue) {
-        piecesDebug[row][col] = 'X';
-      }
+      stream->write(linearHallHealth[row][col].unchangedFrames);
     }
   }
-  return previousPieces != pieces;
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      stream->write(
+        reinterpret_cast<const uint8_t*>(&linearHallHealth[row][col].noise),
+        sizeof(linearHallHealth[row][col].noise));
+    }
+  }
+}
+
+void traceWriteFrame(Stream* stream, uint32_t timestamp) {
+  stream->write(TRACE_FRAME_TAG);
+  stream->write(reinterpret_cast<const uint8_t*>(&timestamp),
+                sizeof(timestamp));
+  stream->write(reinterpret_cast<const uint8_t*>(linearHallValues),
+                sizeof(linearHallValues));
+}
+
+// See Telemetry.h for the format
+void streamWriteFrame(Stream* stream) {
+  uint8_t frame[TELEMETRY_MAX_FRAME_SIZE];
+  const bool keyframe = streamFrames % streamKeyframeInterval == 0;
+  const uint8_t length =
+    telemetryEncodeFrame(linearHallValues, linearHallPreviousValues, keyframe,
+                         streamSequence++, frame);
+  stream->write(frame, length);
+  streamFrames++;
+  streamBytes += length;
 }
 
 void loadSettings() {
   EEPROM.get(AUTO_LOAD_CALIBRATION_EEPROM_START_ADDR, autoLoadCalibration);
   EEPROM.get(DETECTION_METHOD_EEPROM_START_ADDR, detectionMethod);
   EEPROM.get(PRINT_ON_BOARD_CHANGE_EEPROM_START_ADDR, printOnBoardChange);
+  EEPROM.get(ACTIVE_PROFILE_EEPROM_START_ADDR, activeProfile);
+  EEPROM.get(CROSSTALK_COMPENSATION_EEPROM_START_ADDR, crosstalkCompensation);
+  EEPROM.get(FAST_BOOT_EEPROM_START_ADDR, fastBoot);
+  EEPROM.get(MASK_UNHEALTHY_SQUARES_EEPROM_START_ADDR, maskUnhealthySquares);
+  if (activeProfile >= PROFILES_NUM) {
+    activeProfile = 0;
+  }
 }
 
 void saveSettings() {
   EEPROM.put(AUTO_LOAD_CALIBRATION_EEPROM_START_ADDR, autoLoadCalibration);
   EEPROM.put(DETECTION_METHOD_EEPROM_START_ADDR, detectionMethod);
   EEPROM.put(PRINT_ON_BOARD_CHANGE_EEPROM_START_ADDR, printOnBoardChange);
+  EEPROM.put(ACTIVE_PROFILE_EEPROM_START_ADDR, activeProfile);
+  EEPROM.put(CROSSTALK_COMPENSATION_EEPROM_START_ADDR, crosstalkCompensation);
+  EEPROM.put(FAST_BOOT_EEPROM_START_ADDR, fastBoot);
+  EEPROM.put(MASK_UNHEALTHY_SQUARES_EEPROM_START_ADDR, maskUnhealthySquares);
+}
+
+// Reads the board state saved in EEPROM into savedPieces, returns whether
+// there is one
+bool loadBoardState() {
+  boardStateSaved = EEPROM.read(BOARD_STATE_SAVED_EEPROM_START_ADDR) ==
+                    BOARD_STATE_SAVED_MARKER;
+  savedPieces = 0;
+  if (boardStateSaved) {
+    EEPROM.get(BOARD_STATE_EEPROM_START_ADDR, savedPieces);
+  }
+  return boardStateSaved;
+}
+
+// Called every frame, only writes the bytes that changed (EEPROM.put uses
+// update) once the board has settled
+void saveBoardState() {
+  if (!fastBoot || !boardStateConfirmed ||
+      (boardStateSaved && pieces == savedPieces) ||
+      millis() - piecesChangedTime < BOARD_STATE_SAVE_DELAY) {
+    return;
+  }
+  EEPROM.put(BOARD_STATE_EEPROM_START_ADDR, pieces);
+  EEPROM.update(BOARD_STATE_SAVED_EEPROM_START_ADDR, BOARD_STATE_SAVED_MARKER);
+  savedPieces = pieces;
+  boardStateSaved = true;
 }
 
+
+// Stops reporting input once a whole line has been read until nextLine(), so
+// every run of the serial task runs at most one command and the other tasks
+// get their turn in between pipelined commands.
+class OneLineStream : public Stream {
+  public:
+    explicit OneLineStream(Stream* stream) : stream(stream) {}
+
+    void nextLine() {
+      lineRead = false;
+    }
+
+    size_t write(uint8_t c) override {
+      return stream->write(c);
+    }
+    size_t write(const uint8_t* buffer, size_t size) override {
+      return stream->write(buffer, size);
+    }
+    using Print::write;
+
+    int available() override {
+      return lineRead ? 0 : stream->available();
+    }
+
+    int read() override {
+      if (lineRead) {
+        return -1;
+      }
+      const int c = stream->read();
+      if (c == '\n') {
+        lineRead = true;
+      }
+      return c;
+    }
+
+    int peek() override {
+      return lineRead ? -1 : stream->peek();
+    }
+
+    void flush() override {
+      stream->flush();
+    }
+
+  private:
+    Stream* stream;
+    bool lineRead = false;
+};
+OneLineStream serialInput(&Serial);
+
 char serialCommandsBuffer[64];
-SerialCommands serialCommands(&Serial, serialCommandsBuffer,
+SerialCommands serialCommands(&serialInput, serialCommandsBuffer,
                               sizeof(serialCommandsBuffer), "\r\n", " ");
 
+// Status reported at the end of the reply to a tagged command
+const uint8_t COMMAND_STATUS_OK = 0;
+const uint8_t COMMAND_STATUS_ERROR = 1;
+const uint8_t COMMAND_STATUS_UNRECOGNIZED = 2;
+uint8_t commandStatus = COMMAND_STATUS_OK;
+
+// Prefixes every line written with the request ID of the tagged command being
+// run, so replies can be told apart from other output.
+class TaggedStream : public Stream {
+  public:
+    explicit TaggedStream(Stream* stream) : stream(stream) {}
+
+    void begin(uint16_t id) {
+      this->id = id;
+      atLineStart = true;
+    }
+
+    size_t write(uint8_t c) override {
+      if (atLineStart) {
+        stream->write('#');
+        stream->print(id);
+        stream->write(' ');
+        atLineStart = false;
+      }
+      if (c == '\n') {
+        atLineStart = true;
+      }
+      return stream->write(c);
+    }
+    using Print::write;
+
+    int available() override {
+      return stream->available();
+    }
+
+    int read() override {
+      return stream->read();
+    }
+
+    int peek() override {
+      return stream->peek();
+    }
+
+    void flush() override {
+      stream->flush();
+    }
+
+  private:
+    Stream* stream;
+    uint16_t id = 0;
+    bool atLineStart = true;
+};
+TaggedStream taggedStream(&Serial);
+
+void printError(Stream* stream, const __FlashStringHelper* message,
+                const char* value = nullptr) {
+  commandStatus = COMMAND_STATUS_ERROR;
+  if (value == nullptr) {
+    stream->println(message);
+  } else {
+    stream->print(message);
+    stream->println(value);
+  }
+}
+
 void printBitboard(Stream* stream, uint64_t bitboard) {
   for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
     for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
@@ -168,8 +462,8 @@ void printBitboard(Stream* stream, uint64_t bitboard) {
   }
 }
 
-void printMemoryArray(Stream* stream,
-                      uint16_t array[CHESSBOARD_ROWS][CHESSBOARD_COLS],
+template <typename T>
+void printMemoryArray(Stream* stream, T array[CHESSBOARD_ROWS][CHESSBOARD_COLS],
                       uint8_t thisRowOnly = 255, uint8_t thisColOnly = 255) {
   for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
     for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
@@ -239,36 +533,126 @@ uint16_t saveArrayToEEPROM(uint16_t array[CHESSBOARD_ROWS][CHESSBOARD_COLS],
   return bytesUpdated;
 }
 
+// One block read, then swap the big-endian values in place
 uint16_t loadArrayFromEEPROM(uint16_t array[CHESSBOARD_ROWS][CHESSBOARD_COLS],
                              uint16_t startAddr) {
-  uint16_t bytesRead = 0;
+  eeprom_read_block(array, reinterpret_cast<const void*>(startAddr),
+                    arraySizeInEEPROM);
   for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
-    const uint16_t rowAddr =
-      startAddr + row * CHESSBOARD_COLS * sizeof(uint16_t);
     for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
-      const uint8_t highValue = EEPROM.read(rowAddr + col * sizeof(uint16_t));
-      const uint8_t lowValue =
-        EEPROM.read(rowAddr + col * sizeof(uint16_t) + 1);
-      const uint16_t value = (highValue << 8) | lowValue;
-      array[row][col] = value;
-      bytesRead += 2;
+      array[row][col] = __builtin_bswap16(array[row][col]);
     }
   }
+  return arraySizeInEEPROM;
+}
+
+uint16_t profileEEPROMAddr(uint8_t profile) {
+  return PROFILES_EEPROM_START_ADDR + (profile - 1) * PROFILE_SIZE_IN_EEPROM;
+}
+
+bool profileSaved(uint8_t profile) {
+  return profile == 0 ||
+         EEPROM.read(profileEEPROMAddr(profile)) == PROFILE_SAVED_MARKER;
+}
+
+// Saves the present calibration values and margins to a profile, returns the
+// number of bytes updated. marginsClamped is set to the number of margins
+// that didn't fit in a byte. (only for profiles other than 0)
+uint16_t saveProfileToEEPROM(uint8_t profile, uint8_t& marginsClamped) {
+  marginsClamped = 0;
+  if (profile == 0) {
+    return saveArrayToEEPROM(linearHallPresentValues,
+                             PRESENT_CALIBRATION_EEPROM_START_ADDR) +
+           saveArrayToEEPROM(linearHallPresentMargins,
+                             PRESENT_CALIBRATION_MARGIN_EEPROM_START_ADDR);
+  }
+  const uint8_t squares = CHESSBOARD_ROWS * CHESSBOARD_COLS;
+  const uint16_t* values = &linearHallPresentValues[0][0];
+  const uint16_t* margins = &linearHallPresentMargins[0][0];
+  uint16_t addr = profileEEPROMAddr(profile);
+  EEPROM.update(addr++, PROFILE_SAVED_MARKER);
+  for (uint8_t i = 0; i < squares; i++) {
+    EEPROM.update(addr++, values[i] & 0xFF);
+  }
+  for (uint8_t i = 0; i < squares; i += 4) {
+    uint8_t highBits = 0;
+    for (uint8_t j = 0; j < 4; j++) {
+      highBits |= ((values[i + j] >> 8) & 0b11) << (j * 2);
+    }
+    EEPROM.update(addr++, highBits);
+  }
+  for (uint8_t i = 0; i < squares; i++) {
+    if (margins[i] > 0xFF) {
+      marginsClamped++;
+    }
+    EEPROM.update(addr++, min(margins[i], 0xFF));
+  }
+  return PROFILE_SIZE_IN_EEPROM;
+}
+
+// Loads the present calibration values and margins from a profile, returns
+// the number of bytes read.
+uint16_t loadProfileFromEEPROM(uint8_t profile) {
+  if (profile == 0) {
+    return loadArrayFromEEPROM(linearHallPresentValues,
+                               PRESENT_CALIBRATION_EEPROM_START_ADDR) +
+           loadArrayFromEEPROM(linearHallPresentMargins,
+                               PRESENT_CALIBRATION_MARGIN_EEPROM_START_ADDR);
+  }
+  const uint8_t squares = CHESSBOARD_ROWS * CHESSBOARD_COLS;
+  uint16_t* values = &linearHallPresentValues[0][0];
+  uint16_t* margins = &linearHallPresentMargins[0][0];
+  uint16_t addr = profileEEPROMAddr(profile) + 1;
+  for (uint8_t i = 0; i < squares; i++) {
+    values[i] = EEPROM.read(addr++);
+  }
+  for (uint8_t i = 0; i < squares; i += 4) {
+    const uint8_t highBits = EEPROM.read(addr++);
+    for (uint8_t j = 0; j < 4; j++) {
+      values[i + j] |= ((highBits >> (j * 2)) & 0b11) << 8;
+    }
+  }
+  for (uint8_t i = 0; i < squares; i++) {
+    margins[i] = EEPROM.read(addr++);
+  }
+  return PROFILE_SIZE_IN_EEPROM;
+}
+
+// Loads the calibration arrays, the active profile and the crosstalk
+// coefficients in one pass in address order, returns the number of bytes read.
+uint16_t loadCalibrationFromEEPROM() {
+  uint16_t bytesRead = 0;
+  bytesRead += loadArrayFromEEPROM(linearHallPresentValues,
+                                   PRESENT_CALIBRATION_EEPROM_START_ADDR);
+  bytesRead += loadArrayFromEEPROM(linearHallEmptyValues,
+                                   EMPTY_CALIBRATION_EEPROM_START_ADDR);
+  bytesRead += loadArrayFromEEPROM(
+    linearHallPresentMargins, PRESENT_CALIBRATION_MARGIN_EEPROM_START_ADDR);
+  bytesRead += loadArrayFromEEPROM(linearHallEmptyMargins,
+                                   EMPTY_CALIBRATION_MARGIN_EEPROM_START_ADDR);
+  EEPROM.get(CROSSTALK_EEPROM_START_ADDR, linearHallCrosstalk);
+  bytesRead += sizeof(linearHallCrosstalk);
+  if (activeProfile != 0 && profileSaved(activeProfile)) {
+    bytesRead += loadProfileFromEEPROM(activeProfile);
+  }
   return bytesRead;
 }
 
-// print [pieces|piecesDebug|raw|presentCalibration|presentCalibrationEEPROM|
-//     emptyCalibration|emptyCalibrationEEPROM|presentCalibrationMargin|
-//     presentCalibrationMarginEEPROM|emptyCalibrationMargin|
-//     emptyCalibrationMarginEEPROM|all]
+// print [pieces|piecesDebug|confidence|raw|presentCalibration|
+//     presentCalibrationEEPROM|emptyCalibration|emptyCalibrationEEPROM|
+//     presentCalibrationMargin|presentCalibrationMarginEEPROM|
+//     emptyCalibrationMargin|emptyCalibrationMarginEEPROM|boot|all]
 //   Prints the values of the linear hall sensors or the calibration values.
 //
-//   pieces|raw|presentCalibration|presentCalibrationEEPROM|emptyCalibration|
+//   pieces|piecesDebug|confidence|raw|presentCalibration|
+//       presentCalibrationEEPROM|emptyCalibration|
 //       emptyCalibrationEEPROM|presentCalibrationMargin|
 //       presentCalibrationMarginEEPROM|emptyCalibrationMargin|
-//       emptyCalibrationMarginEEPROM|all: The type of value to print.
+//       emptyCalibrationMarginEEPROM|boot|all: The type of value to print.
 //     `pieces` prints the current state of the chessboard.
 //     `piecesDebug` prints the current state of the chessboard with debug
+//     `confidence` prints how confident the likelihood model is of the state
+//       of each square. (0 - 255, see detectionUpdatePieces)
 //     `raw` prints the raw values of the linear hall sensors.
 //     `presentCalibration` prints the calibration values for squares with a
 //       piece present.
@@ -286,6 +670,7 @@ uint16_t loadArrayFromEEPROM(uint16_t array[CHESSBOARD_ROWS][CHESSBOARD_COLS],
 //       squares with no piece present.
 //     `emptyCalibrationMarginEEPROM` prints the calibration margin values for
 //       squares with no piece present stored in EEPROM.
+//     `boot` prints how long booting took, see the FAST_BOOT setting.
 //     `all` prints all of the above.
 void cmdPrint(SerialCommands* sender) {
   Stream* s = sender->GetSerial();
@@ -293,6 +678,7 @@ void cmdPrint(SerialCommands* sender) {
 
   const static char PIECES_STRING[] PROGMEM = "pieces";
   const static char PIECES_DEBUG_STRING[] PROGMEM = "piecesDebug";
+  const static char CONFIDENCE_STRING[] PROGMEM = "confidence";
   const static char RAW_STRING[] PROGMEM = "raw";
   const static char PRESENT_CALIBRATION_STRING[] PROGMEM = "presentCalibration";
   const static char PRESENT_CALIBRATION_EEPROM_STRING[] PROGMEM =
@@ -308,6 +694,7 @@ void cmdPrint(SerialCommands* sender) {
     "emptyCalibrationMargin";
   const static char EMPTY_CALIBRATION_MARGIN_EEPROM_STRING[] PROGMEM =
     "emptyCalibrationMarginEEPROM";
+  const static char BOOT_STRING[] PROGMEM = "boot";
   const static char ALL_STRING[] PROGMEM = "all";
   const bool printAll = type != nullptr && strcmp_P(type, ALL_STRING) == 0;
   bool printedSomething = false;
@@ -320,14 +707,30 @@ void cmdPrint(SerialCommands* sender) {
     s->println(F("Printing pieces with debugging"));
     s->println(F("<-------[---empty---]-------[---present---]------->\n"
                  "    -         .         ?          0          X"));
+    uint8_t occupiedRows[CHESSBOARD_ROWS];
+    detectionBitboardRows(previousPieces, occupiedRows);
     for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
       for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
-        s->write(piecesDebug[row][col]);
+        const uint16_t value =
+          crosstalkCompensation
+            ? detectionCompensatedValue(linearHallValues, linearHallEmptyValues,
+                                        linearHallCrosstalk, occupiedRows, row,
+                                        col)
+            : linearHallValues[row][col];
+        s->write(detectionDebugSymbol(
+          value, linearHallPresentValues[row][col],
+          linearHallEmptyValues[row][col], linearHallPresentMargins[row][col],
+          linearHallEmptyMargins[row][col]));
       }
       s->println();
     }
     printedSomething = true;
   }
+  if (strcmp_P(type, CONFIDENCE_STRING) == 0 || printAll) {
+    s->println(F("Printing piece confidence values"));
+    printMemoryArray(s, piecesConfidence);
+    printedSomething = true;
+  }
   if (strcmp_P(type, RAW_STRING) == 0 || printAll) {
     s->println(F("Printing raw values"));
     printMemoryArray(s, linearHallValues);
@@ -374,9 +777,30 @@ void cmdPrint(SerialCommands* sender) {
     printEEPROMArray(s, EMPTY_CALIBRATION_MARGIN_EEPROM_START_ADDR);
     printedSomething = true;
   }
+  if (strcmp_P(type, BOOT_STRING) == 0 || printAll) {
+    s->println(F("Printing boot timing"));
+    s->print(F("Fast boot: "));
+    s->println(fastBoot);
+    s->print(F("Time to ready (us): "));
+    s->println(readyTime);
+    s->print(F("Time to confirmed board state (ms): "));
+    if (!boardStateConfirmed) {
+      s->println(F("pending"));
+    } else if (boardStateRestored) {
+      s->println(boardStateConfirmedTime);
+    } else {
+      s->println(F("not restored"));
+    }
+    if (boardStateSaved) {
+      s->println(F("Board state saved in EEPROM:"));
+      printBitboard(s, savedPieces);
+    } else {
+      s->println(F("Board state saved in EEPROM: none"));
+    }
+    printedSomething = true;
+  }
   if (!printedSomething) {
-    s->print(F("Invalid print type: "));
-    s->println(type);
+    printError(s, F("Invalid print type: "), type);
   }
 }
 SerialCommand cmdObjPrint("print", cmdPrint);
@@ -403,7 +827,7 @@ void cmdCalibrate(SerialCommands* sender) {
   char* type = sender->Next();
 
   if (type == nullptr) {
-    s->println(F("Missing calibration type"));
+    printError(s, F("Missing calibration type"));
     return;
   }
 
@@ -421,14 +845,13 @@ void cmdCalibrate(SerialCommands* sender) {
   } else if (strcmp_P(type, EMPTY_MARGIN_STRING) == 0) {
     array = linearHallEmptyMargins;
   } else {
-    s->print(F("Invalid calibration type: "));
-    s->println(type);
+    printError(s, F("Invalid calibration type: "), type);
     return;
   }
 
   char* action = sender->Next();
   if (action == nullptr) {
-    s->println(F("Missing action"));
+    printError(s, F("Missing action"));
     return;
   }
 
@@ -442,14 +865,13 @@ void cmdCalibrate(SerialCommands* sender) {
   } else if (strcmp_P(action, SET_STRING) == 0) {
     act = ACT_SET;
   } else {
-    s->print(F("Invalid action: "));
-    s->println(action);
+    printError(s, F("Invalid action: "), action);
     return;
   }
 
   char* position = sender->Next();
   if (position == nullptr) {
-    s->println(F("Missing position"));
+    printError(s, F("Missing position"));
     return;
   }
 
@@ -460,14 +882,14 @@ void cmdCalibrate(SerialCommands* sender) {
     char* rowStr = strtok(position, ",");
     char* colStr = strtok(nullptr, ",");
     if (rowStr == nullptr || colStr == nullptr) {
-      s->println(F("Invalid position"));
+      printError(s, F("Invalid position"));
       return;
     }
     row = atoi(rowStr);
     col = atoi(colStr);
     if ((row >= CHESSBOARD_ROWS && row != 255) ||
         (col >= CHESSBOARD_COLS && col != 255) || row < 0 || col < 0) {
-      s->println(F("Invalid position"));
+      printError(s, F("Invalid position"));
       return;
     }
   } else {
@@ -584,27 +1006,51 @@ void cmdCalibrate(SerialCommands* sender) {
         s->println(value);
         array[row][col] = value;
       }
+      linearHallLikelihoodsValid = false;
       break;
     }
     default: {
-      s->println(F("Invalid action"));
+      printError(s, F("Invalid action"));
       break;
     }
   }
 }
 SerialCommand cmdObjCalibrate("calibrate", cmdCalibrate);
 
+// The present calibration in EEPROM is profile 0's, the other profiles' are
+// only saved and loaded with `profile`. Returns whether the present
+// calibration of type may be saved or loaded.
+bool checkPresentCalibrationProfile(Stream* stream, const char* type) {
+  const static char PRESENT_STRING[] PROGMEM = "present";
+  const static char PRESENT_MARGIN_STRING[] PROGMEM = "presentMargin";
+  const static char ALL_STRING[] PROGMEM = "all";
+  if (activeProfile == 0 || (strcmp_P(type, PRESENT_STRING) != 0 &&
+                             strcmp_P(type, PRESENT_MARGIN_STRING) != 0 &&
+                             strcmp_P(type, ALL_STRING) != 0)) {
+    return true;
+  }
+  const char profile[] = {static_cast<char>('0' + activeProfile), '\0'};
+  printError(stream, F("Use `profile` for the present calibration of profile "),
+             profile);
+  return false;
+}
+
 // calibrationSaveToEEPROM [present|empty|presentMargin|emptyMargin|all]
 //   Saves the calibration values to EEPROM.
 //
 //   present|empty|presentMargin|emptyMargin: The type of calibration to save.
-//     See `calibrate` for the types or "all" to save all types.
+//     See `calibrate` for the types or "all" to save all types. The present
+//     values and margins are profile 0's, so they can't be saved while
+//     another profile is active. (see `profile`)
 void cmdCalibrationSaveToEEPROM(SerialCommands* sender) {
   Stream* s = sender->GetSerial();
 
   char* type = sender->Next();
   if (type == nullptr) {
-    s->println(F("Missing calibration type"));
+    printError(s, F("Missing calibration type"));
+    return;
+  }
+  if (!checkPresentCalibrationProfile(s, type)) {
     return;
   }
   uint16_t bytesUpdated = 0;
@@ -644,8 +1090,7 @@ void cmdCalibrationSaveToEEPROM(SerialCommands* sender) {
     bytesUpdated += saveArrayToEEPROM(
       linearHallEmptyMargins, EMPTY_CALIBRATION_MARGIN_EEPROM_START_ADDR);
   } else {
-    s->print(F("Invalid calibration type: "));
-    s->println(type);
+    printError(s, F("Invalid calibration type: "), type);
     return;
   }
   s->print(F("Bytes updated: "));
@@ -658,13 +1103,18 @@ SerialCommand cmdObjCalibrationSaveToEEPROM("calibrationSaveToEEPROM",
 //   Loads the calibration values from EEPROM.
 //
 //   present|empty|presentMargin|emptyMargin: The type of calibration to load.
-//     See `calibrate` for the types or "all" to load all types.
+//     See `calibrate` for the types or "all" to load all types. The present
+//     values and margins are profile 0's, so they can't be loaded while
+//     another profile is active. (see `profile`)
 void cmdCalibrationLoadFromEEPROM(SerialCommands* sender) {
   Stream* s = sender->GetSerial();
 
   char* type = sender->Next();
   if (type == nullptr) {
-    s->println(F("Missing calibration type"));
+    printError(s, F("Missing calibration type"));
+    return;
+  }
+  if (!checkPresentCalibrationProfile(s, type)) {
     return;
   }
   uint16_t bytesRead = 0;
@@ -705,16 +1155,94 @@ void cmdCalibrationLoadFromEEPROM(SerialCommands* sender) {
     bytesRead += loadArrayFromEEPROM(
       linearHallEmptyMargins, EMPTY_CALIBRATION_MARGIN_EEPROM_START_ADDR);
   } else {
-    s->print(F("Invalid calibration type: "));
-    s->println(type);
+    printError(s, F("Invalid calibration type: "), type);
     return;
   }
+  linearHallLikelihoodsValid = false;
   s->print(F("Bytes read: "));
   s->println(bytesRead);
 }
 SerialCommand cmdObjCalibrationLoadFromEEPROM("calibrationLoadFromEEPROM",
                                               cmdCalibrationLoadFromEEPROM);
 
+// profile [load|save|list] [number?]
+//   Switches between calibration profiles for different piece sets. A profile
+//   holds the present calibration values and margins, the empty calibration is
+//   shared by all profiles. Profile 0 is the calibration saved with
+//   `calibrationSaveToEEPROM`, the other profiles store margins up to 255.
+//
+//   load|save|list: The action to perform.
+//     `load` loads a profile and makes it the active profile, which is loaded
+//       on startup if AUTO_LOAD_CALIBRATION is enabled.
+//     `save` saves the current present calibration to a profile and makes it
+//       the active profile.
+//     `list` lists the profiles.
+//   number: The profile to load or save. (0 - 2) Ignored if listing.
+void cmdProfile(SerialCommands* sender) {
+  Stream* s = sender->GetSerial();
+
+  char* action = sender->Next();
+  if (action == nullptr) {
+    printError(s, F("Missing action"));
+    return;
+  }
+  const static char LOAD_STRING[] PROGMEM = "load";
+  const static char SAVE_STRING[] PROGMEM = "save";
+  const static char LIST_STRING[] PROGMEM = "list";
+  if (strcmp_P(action, LIST_STRING) == 0) {
+    s->println(F("Printing profiles"));
+    for (uint8_t profile = 0; profile < PROFILES_NUM; profile++) {
+      s->print(profile);
+      s->print(profileSaved(profile) ? F(": saved") : F(": empty"));
+      s->println(profile == activeProfile ? F(" (active)") : F(""));
+    }
+    return;
+  }
+  const bool load = strcmp_P(action, LOAD_STRING) == 0;
+  if (!load && strcmp_P(action, SAVE_STRING) != 0) {
+    printError(s, F("Invalid action: "), action);
+    return;
+  }
+
+  char* numberStr = sender->Next();
+  if (numberStr == nullptr) {
+    printError(s, F("Missing profile number"));
+    return;
+  }
+  const int16_t profile = atoi(numberStr);
+  if (profile < 0 || profile >= PROFILES_NUM) {
+    printError(s, F("Invalid profile number: "), numberStr);
+    return;
+  }
+
+  if (load) {
+    if (!profileSaved(profile)) {
+      printError(s, F("Profile has not been saved: "), numberStr);
+      return;
+    }
+    s->print(F("Loading profile "));
+    s->println(profile);
+    const uint16_t bytesRead = loadProfileFromEEPROM(profile);
+    linearHallLikelihoodsValid = false;
+    s->print(F("Bytes read: "));
+    s->println(bytesRead);
+  } else {
+    s->print(F("Saving profile "));
+    s->println(profile);
+    uint8_t marginsClamped = 0;
+    const uint16_t bytesUpdated = saveProfileToEEPROM(profile, marginsClamped);
+    if (marginsClamped > 0) {
+      s->print(F("Margins clamped to 255: "));
+      s->println(marginsClamped);
+    }
+    s->print(F("Bytes updated: "));
+    s->println(bytesUpdated);
+  }
+  activeProfile = profile;
+  saveSettings();
+}
+SerialCommand cmdObjProfile("profile", cmdProfile);
+
 // settings [set|get] [key] [value?]
 //   Gets or sets a setting. These changes are automatically loaded and written
 //   to EEPROM and take effect immediately.
@@ -729,16 +1257,33 @@ SerialCommand cmdObjCalibrationLoadFromEEPROM("calibrationLoadFromEEPROM",
 //       1: Check for the square to be not empty.
 //       2: Check for the square to be present.
 //       3: Check for either the square to be not empty or present.
+//       4: Pick whichever of empty or present is more likely, modelling the
+//         margins as 2 standard deviations.
 //     "PRINT_ON_BOARD_CHANGE"
 //       0: Don't automatically print the board state when it changes.
 //       1: Automatically print the board state when it changes.
+//     "ACTIVE_PROFILE"
+//       0 - 2: The calibration profile to load on startup. Setting this loads
+//         the profile now. (see `profile`)
+//     "CROSSTALK_COMPENSATION"
+//       0: Don't compensate for crosstalk between neighbouring squares.
+//       1: Subtract the crosstalk measured with `crosstalk measure` from
+//         occupied neighbours before classifying squares.
+//     "FAST_BOOT"
+//       0: Print progress while starting up and save nothing extra.
+//       1: Start without progress lines or the startup delay, save the board
+//         state to EEPROM whenever it settles and restore it on startup.
+//     "MASK_UNHEALTHY_SQUARES"
+//       0: Report squares flagged by `health` like any other square.
+//       1: Keep the last state of squares flagged by `health` until they are
+//         healthy again.
 //   value: The value to set the setting to. Ignored if getting setting.
 void cmdSettings(SerialCommands* sender) {
   Stream* s = sender->GetSerial();
 
   char* action = sender->Next();
   if (action == nullptr) {
-    s->println(F("Missing action"));
+    printError(s, F("Missing action"));
     return;
   }
   const uint8_t ACT_GET = 0;
@@ -751,14 +1296,13 @@ void cmdSettings(SerialCommands* sender) {
   } else if (strcmp_P(action, SET_STRING) == 0) {
     act = ACT_SET;
   } else {
-    s->print(F("Invalid action: "));
-    s->println(action);
+    printError(s, F("Invalid action: "), action);
     return;
   }
 
   char* key = sender->Next();
   if (key == nullptr) {
-    s->println(F("Missing key"));
+    printError(s, F("Missing key"));
     return;
   }
 
@@ -767,6 +1311,12 @@ void cmdSettings(SerialCommands* sender) {
   const static char DETECTION_METHOD_STRING[] PROGMEM = "DETECTION_METHOD";
   const static char PRINT_ON_BOARD_CHANGE_STRING[] PROGMEM =
     "PRINT_ON_BOARD_CHANGE";
+  const static char ACTIVE_PROFILE_STRING[] PROGMEM = "ACTIVE_PROFILE";
+  const static char CROSSTALK_COMPENSATION_STRING[] PROGMEM =
+    "CROSSTALK_COMPENSATION";
+  const static char FAST_BOOT_STRING[] PROGMEM = "FAST_BOOT";
+  const static char MASK_UNHEALTHY_SQUARES_STRING[] PROGMEM =
+    "MASK_UNHEALTHY_SQUARES";
 
   if (act == ACT_GET) {
     if (strcmp_P(key, AUTO_LOAD_CALIBRATION_STRING) == 0) {
@@ -778,9 +1328,20 @@ void cmdSettings(SerialCommands* sender) {
     } else if (strcmp_P(key, PRINT_ON_BOARD_CHANGE_STRING) == 0) {
       s->println(F("Printing PRINT_ON_BOARD_CHANGE setting value"));
       s->println(printOnBoardChange);
+    } else if (strcmp_P(key, ACTIVE_PROFILE_STRING) == 0) {
+      s->println(F("Printing ACTIVE_PROFILE setting value"));
+      s->println(activeProfile);
+    } else if (strcmp_P(key, CROSSTALK_COMPENSATION_STRING) == 0) {
+      s->println(F("Printing CROSSTALK_COMPENSATION setting value"));
+      s->println(crosstalkCompensation);
+    } else if (strcmp_P(key, FAST_BOOT_STRING) == 0) {
+      s->println(F("Printing FAST_BOOT setting value"));
+      s->println(fastBoot);
+    } else if (strcmp_P(key, MASK_UNHEALTHY_SQUARES_STRING) == 0) {
+      s->println(F("Printing MASK_UNHEALTHY_SQUARES setting value"));
+      s->println(maskUnhealthySquares);
     } else {
-      s->print(F("Invalid key: "));
-      s->println(key);
+      printError(s, F("Invalid key: "), key);
     }
     return;
   }
@@ -792,109 +1353,730 @@ void cmdSettings(SerialCommands* sender) {
       keyAsInt = 1;
     } else if (strcmp_P(key, PRINT_ON_BOARD_CHANGE_STRING) == 0) {
       keyAsInt = 2;
+    } else if (strcmp_P(key, ACTIVE_PROFILE_STRING) == 0) {
+      keyAsInt = 3;
+    } else if (strcmp_P(key, CROSSTALK_COMPENSATION_STRING) == 0) {
+      keyAsInt = 4;
+    } else if (strcmp_P(key, FAST_BOOT_STRING) == 0) {
+      keyAsInt = 5;
+    } else if (strcmp_P(key, MASK_UNHEALTHY_SQUARES_STRING) == 0) {
+      keyAsInt = 6;
     } else {
-      s->print(F("Invalid key: "));
-      s->println(key);
+      printError(s, F("Invalid key: "), key);
       return;
     }
   }
 
   char* valueStr = sender->Next();
   if (valueStr == nullptr) {
-    s->println(F("Missing value"));
+    printError(s, F("Missing value"));
     return;
   }
   int32_t value = atoi(valueStr);
   if (keyAsInt == 0) {
     if (value != 0 && value != 1) {
-      s->println(F("Invalid value for AUTO_LOAD_CALIBRATION"));
+      printError(s, F("Invalid value for AUTO_LOAD_CALIBRATION"));
       return;
     }
-    Serial.print(F("Setting AUTO_LOAD_CALIBRATION to "));
-    Serial.println(value);
+    s->print(F("Setting AUTO_LOAD_CALIBRATION to "));
+    s->println(value);
     autoLoadCalibration = value;
   } else if (keyAsInt == 1) {
-    if (value < 0 || value > 3) {
-      s->println(F("Invalid value for DETECTION_METHOD"));
+    if (value < 0 || value > 4) {
+      printError(s, F("Invalid value for DETECTION_METHOD"));
       return;
     }
-    Serial.print(F("Setting DETECTION_METHOD to "));
-    Serial.println(value);
+    s->print(F("Setting DETECTION_METHOD to "));
+    s->println(value);
     detectionMethod = value;
   } else if (keyAsInt == 2) {
     if (value != 0 && value != 1) {
-      s->println(F("Invalid value for PRINT_ON_BOARD_CHANGE"));
+      printError(s, F("Invalid value for PRINT_ON_BOARD_CHANGE"));
       return;
     }
-    Serial.print(F("Setting PRINT_ON_BOARD_CHANGE to "));
-    Serial.println(value);
+    s->print(F("Setting PRINT_ON_BOARD_CHANGE to "));
+    s->println(value);
     printOnBoardChange = value;
+  } else if (keyAsInt == 3) {
+    if (value < 0 || value >= PROFILES_NUM || !profileSaved(value)) {
+      printError(s, F("Invalid value for ACTIVE_PROFILE"));
+      return;
+    }
+    s->print(F("Setting ACTIVE_PROFILE to "));
+    s->println(value);
+    activeProfile = value;
+    loadProfileFromEEPROM(activeProfile);
+    linearHallLikelihoodsValid = false;
+  } else if (keyAsInt == 4) {
+    if (value != 0 && value != 1) {
+      printError(s, F("Invalid value for CROSSTALK_COMPENSATION"));
+      return;
+    }
+    s->print(F("Setting CROSSTALK_COMPENSATION to "));
+    s->println(value);
+    crosstalkCompensation = value;
+  } else if (keyAsInt == 5) {
+    if (value != 0 && value != 1) {
+      printError(s, F("Invalid value for FAST_BOOT"));
+      return;
+    }
+    s->print(F("Setting FAST_BOOT to "));
+    s->println(value);
+    if (value && !fastBoot) {
+      // Only read on startup with FAST_BOOT enabled, and EEPROM may hold an
+      // old board state from the last time it was
+      loadBoardState();
+    }
+    fastBoot = value;
+  } else if (keyAsInt == 6) {
+    if (value != 0 && value != 1) {
+      printError(s, F("Invalid value for MASK_UNHEALTHY_SQUARES"));
+      return;
+    }
+    s->print(F("Setting MASK_UNHEALTHY_SQUARES to "));
+    s->println(value);
+    maskUnhealthySquares = value;
   }
   saveSettings();
 }
 SerialCommand cmdObjSettings("settings", cmdSettings);
 
+void printStreamStats(Stream* stream) {
+  const uint32_t elapsed =
+    (streaming ? millis() : streamStopTime) - streamStartTime;
+  stream->print(F("Frames sent: "));
+  stream->println(streamFrames);
+  stream->print(F("Bytes sent: "));
+  stream->println(streamBytes);
+  if (streamFrames == 0 || elapsed == 0) {
+    return;
+  }
+  stream->print(F("Bytes per frame: "));
+  stream->println(static_cast<float>(streamBytes) / streamFrames);
+  stream->print(F("Compression ratio: "));
+  stream->println(static_cast<float>(streamFrames) * TELEMETRY_RAW_FRAME_SIZE /
+                  streamBytes);
+  stream->print(F("Frames per second: "));
+  stream->println(streamFrames * 1000.0 / elapsed);
+}
+
+// An expander is suspect when at least this many of its channels are
+const uint8_t EXPANDER_SUSPECT_SQUARES = CHESSBOARD_COLS / 2;
+
+// health [reset?]
+//   Lists the squares with a railed, stuck or noisy sensor (see Health.h) and
+//   the expanders and channels they point to.
+//
+//   reset: Forget the health history of every square.
+void cmdHealth(SerialCommands* sender) {
+  Stream* s = sender->GetSerial();
+
+  char* action = sender->Next();
+  const static char RESET_STRING[] PROGMEM = "reset";
+  if (action != nullptr) {
+    if (strcmp_P(action, RESET_STRING) != 0) {
+      printError(s, F("Invalid action: "), action);
+      return;
+    }
+    s->println(F("Resetting sensor health"));
+    memset(linearHallHealth, 0, sizeof(linearHallHealth));
+    unhealthySquares = 0;
+    return;
+  }
+
+  s->println(F("Printing sensor health"));
+  uint8_t suspectSquares = 0;
+  uint8_t suspectChannels = 0xFF;
+  for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+    uint8_t expanderSuspectSquares = 0;
+    uint8_t expanderSuspectChannels = 0;
+    for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+      const SensorHealth& health = linearHallHealth[row][col];
+      const uint8_t flags = healthFlags(
+        linearHallValues[row][col], linearHallPresentValues[row][col],
+        linearHallEmptyValues[row][col], linearHallPresentMargins[row][col],
+        linearHallEmptyMargins[row][col], health);
+      if (flags == 0) {
+        continue;
+      }
+      suspectSquares++;
+      expanderSuspectSquares++;
+      expanderSuspectChannels |= 1 << col;
+      s->print(row);
+      s->print(F(","));
+      s->print(col);
+      s->print(F(":"));
+      if (flags & HEALTH_RAILED) {
+        s->print(F(" railed"));
+      }
+      if (flags & HEALTH_STUCK) {
+        s->print(F(" stuck"));
+      }
+      if (flags & HEALTH_NOISY) {
+        s->print(F(" noisy"));
+      }
+      s->print(F(" (value "));
+      s->print(linearHallValues[row][col]);
+      s->print(F(", average change "));
+      s->print(static_cast<float>(health.noise) / HEALTH_NOISE_SCALE);
+      s->println(F(")"));
+    }
+    suspectChannels &= expanderSuspectChannels;
+    if (expanderSuspectSquares >= EXPANDER_SUSPECT_SQUARES) {
+      s->print(F("Suspect expander "));
+      s->print(row);
+      s->print(F(" on pin A"));
+      s->print(EXPANDER_COMS_PINS[row] - A0);
+      s->print(F(" with "));
+      s->print(expanderSuspectSquares);
+      s->println(F(" suspect channels"));
+    }
+  }
+  for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+    if (suspectChannels & (1 << col)) {
+      s->print(F("Channel "));
+      s->print(EXPANDER_COLS_TO_BITS[col]);
+      s->print(F(" (column "));
+      s->print(col);
+      s->println(F(") is suspect on every expander, check the select pins"));
+    }
+  }
+  s->print(F("Suspect squares: "));
+  s->println(suspectSquares);
+  s->print(F("Masked from board changes: "));
+  s->println(maskUnhealthySquares ? suspectSquares : 0);
+}
+SerialCommand cmdObjHealth("health", cmdHealth);
+
+// stream [start|stop|stats] [keyframeInterval?]
+//   Streams delta-compressed raw linear hall values. (see Telemetry.h) Text
+//   from other commands is only ever printed in between frames.
+//
+//   start|stop|stats: The action to perform.
+//     `start` starts streaming every frame scanned, beginning with a
+//       keyframe.
+//     `stop` stops streaming and prints the statistics.
+//     `stats` prints the number of frames and bytes sent, the compression
+//       ratio compared to raw 16-bit values and the frames per second.
+//   keyframeInterval: Frames between keyframes when starting. (1 - 255,
+//     default 32)
+void cmdStream(SerialCommands* sender) {
+  Stream* s = sender->GetSerial();
+
+  char* action = sender->Next();
+  if (action == nullptr) {
+    printError(s, F("Missing action"));
+    return;
+  }
+  const static char START_STRING[] PROGMEM = "start";
+  const static char STOP_STRING[] PROGMEM = "stop";
+  const static char STATS_STRING[] PROGMEM = "stats";
+  if (strcmp_P(action, START_STRING) == 0) {
+    if (tracing) {
+      printError(s, F("Stop tracing before streaming"));
+      return;
+    }
+    char* intervalStr = sender->Next();
+    uint8_t interval = 32;
+    if (intervalStr != nullptr) {
+      const int16_t value = atoi(intervalStr);
+      if (value < 1 || value > 255) {
+        printError(s, F("Invalid keyframe interval: "), intervalStr);
+        return;
+      }
+      interval = value;
+    }
+    s->print(F("Starting stream with a keyframe every "));
+    s->print(interval);
+    s->println(F(" frames"));
+    streamKeyframeInterval = interval;
+    streamSequence = 0;
+    streamFrames = 0;
+    streamBytes = 0;
+    streamStartTime = millis();
+    streaming = true;
+  } else if (strcmp_P(action, STOP_STRING) == 0) {
+    if (streaming) {
+      streamStopTime = millis();
+    }
+    streaming = false;
+    s->println(F("Stopped stream"));
+    printStreamStats(s);
+  } else if (strcmp_P(action, STATS_STRING) == 0) {
+    s->println(F("Printing stream statistics"));
+    printStreamStats(s);
+  } else {
+    printError(s, F("Invalid action: "), action);
+  }
+}
+SerialCommand cmdObjStream("stream", cmdStream);
+
+// Averages the linear hall values of a square and its neighbours over a few
+// scans, for measuring crosstalk
+void linearHallsReadNeighbourhood(uint8_t row, uint8_t col,
+                                  uint16_t averages[3][3]) {
+  const uint8_t SCANS = 8;
+  memset(averages, 0, sizeof(uint16_t) * 3 * 3);
+  for (uint8_t scan = 0; scan < SCANS; scan++) {
+    linearHallsRead();
+    for (int8_t dRow = -1; dRow <= 1; dRow++) {
+      for (int8_t dCol = -1; dCol <= 1; dCol++) {
+        const int8_t r = row + dRow;
+        const int8_t c = col + dCol;
+        if (r >= 0 && r < CHESSBOARD_ROWS && c >= 0 && c < CHESSBOARD_COLS) {
+          averages[dRow + 1][dCol + 1] += linearHallValues[r][c];
+        }
+      }
+    }
+  }
+  for (uint8_t i = 0; i < 3; i++) {
+    for (uint8_t j = 0; j < 3; j++) {
+      averages[i][j] /= SCANS;
+    }
+  }
+}
+
+// crosstalk [measure|get|clear|save|load] [row,col?]
+//   Measures or manages how much each square's piece bleeds into its
+//   neighbours. (see CROSSTALK_COMPENSATION in `settings`)
+//
+//   measure|get|clear|save|load: The action to perform.
+//     `measure` measures the crosstalk of a square. Only that square may have
+//       a piece on it and its neighbours must be empty, while the empty
+//       calibration must be correct.
+//     `get` prints the orthogonal and diagonal coefficients of all squares in
+//       1/64ths of the square's shift from its empty value.
+//     `clear` sets all coefficients to 0.
+//     `save` saves the coefficients to EEPROM.
+//     `load` loads the coefficients from EEPROM. (also done on startup if
+//       AUTO_LOAD_CALIBRATION is enabled)
+//   row,col: The square to measure. Ignored for other actions.
+void cmdCrosstalk(SerialCommands* sender) {
+  Stream* s = sender->GetSerial();
+
+  char* action = sender->Next();
+  if (action == nullptr) {
+    printError(s, F("Missing action"));
+    return;
+  }
+  const static char MEASURE_STRING[] PROGMEM = "measure";
+  const static char GET_STRING[] PROGMEM = "get";
+  const static char CLEAR_STRING[] PROGMEM = "clear";
+  const static char SAVE_STRING[] PROGMEM = "save";
+  const static char LOAD_STRING[] PROGMEM = "load";
+  if (strcmp_P(action, GET_STRING) == 0) {
+    s->println(F("Printing orthogonal and diagonal crosstalk coefficients"));
+    for (uint8_t row = 0; row < CHESSBOARD_ROWS; row++) {
+      for (uint8_t col = 0; col < CHESSBOARD_COLS; col++) {
+        const uint8_t packed = linearHallCrosstalk[row][col];
+        s->print(detectionCrosstalkOrthogonal(packed));
+        s->print(',');
+        s->print(detectionCrosstalkDiagonal(packed));
+        s->print(F("  "));
+      }
+      s->println();
+    }
+    return;
+  } else if (strcmp_P(action, CLEAR_STRING) == 0) {
+    s->println(F("Clearing crosstalk coefficients"));
+    memset(linearHallCrosstalk, 0, sizeof(linearHallCrosstalk));
+    return;
+  } else if (strcmp_P(action, SAVE_STRING) == 0) {
+    s->println(F("Saving crosstalk coefficients to EEPROM"));
+    EEPROM.put(CROSSTALK_EEPROM_START_ADDR, linearHallCrosstalk);
+    return;
+  } else if (strcmp_P(action, LOAD_STRING) == 0) {
+    s->println(F("Loading crosstalk coefficients from EEPROM"));
+    EEPROM.get(CROSSTALK_EEPROM_START_ADDR, linearHallCrosstalk);
+    return;
+  } else if (strcmp_P(action, MEASURE_STRING) != 0) {
+    printError(s, F("Invalid action: "), action);
+    return;
+  }
+
+  char* position = sender->Next();
+  if (position == nullptr) {
+    printError(s, F("Missing position"));
+    return;
+  }
+  char* rowStr = strtok(position, ",");
+  char* colStr = strtok(nullptr, ",");
+  if (rowStr == nullptr || colStr == nullptr) {
+    printError(s, F("Invalid position"));
+    return;
+  }
+  const uint8_t row = atoi(rowStr);
+  const uint8_t col = atoi(colStr);
+  if (row >= CHESSBOARD_ROWS || col >= CHESSBOARD_COLS) {
+    printError(s, F("Invalid position"));
+    return;
+  }
+
+  s->print(F("Measuring crosstalk for row "));
+  s->print(row);
+  s->print(F(" col "));
+  s->println(col);
+  uint16_t averages[3][3];
+  linearHallsReadNeighbourhood(row, col, averages);
+  const int16_t sourceShift = averages[1][1] - linearHallEmptyValues[row][col];
+  if (abs(sourceShift) <= linearHallEmptyMargins[row][col]) {
+    printError(s, F("No piece detected on the square"));
+    return;
+  }
+  int32_t orthogonalShift = 0;
+  int32_t diagonalShift = 0;
+  uint8_t orthogonalCount = 0;
+  uint8_t diagonalCount = 0;
+  for (int8_t dRow = -1; dRow <= 1; dRow++) {
+    for (int8_t dCol = -1; dCol <= 1; dCol++) {
+      const int8_t r = row + dRow;
+      const int8_t c = col + dCol;
+      if ((dRow == 0 && dCol == 0) || r < 0 || r >= CHESSBOARD_ROWS || c < 0 ||
+          c >= CHESSBOARD_COLS) {
+        continue;
+      }
+      const int16_t shift =
+        averages[dRow + 1][dCol + 1] - linearHallEmptyValues[r][c];
+      if (dRow == 0 || dCol == 0) {
+        orthogonalShift += shift;
+        orthogonalCount++;
+      } else {
+        diagonalShift += shift;
+        diagonalCount++;
+      }
+    }
+  }
+  const int8_t orthogonal =
+    constrain(round(orthogonalShift * 64.0 / (sourceShift * orthogonalCount)),
+              DETECTION_CROSSTALK_MIN, DETECTION_CROSSTALK_MAX);
+  const int8_t diagonal =
+    constrain(round(diagonalShift * 64.0 / (sourceShift * diagonalCount)),
+              DETECTION_CROSSTALK_MIN, DETECTION_CROSSTALK_MAX);
+  linearHallCrosstalk[row][col] = detectionPackCrosstalk(orthogonal, diagonal);
+  s->print(F("Orthogonal and diagonal coefficients: "));
+  s->print(orthogonal);
+  s->print(',');
+  s->println(diagonal);
+}
+SerialCommand cmdObjCrosstalk("crosstalk", cmdCrosstalk);
+
+// trace [start|stop]
+//   Starts or stops streaming a binary raw-frame trace. (see Trace.h)
+//
+//   start|stop: Whether to start or stop tracing.
+//     `start` writes the trace header with the current calibration, settings
+//       and detection state just before the next frame, and then writes every
+//       frame scanned until stopped. Board change printing is suspended while
+//       tracing.
+//     `stop` stops writing frames.
+void cmdTrace(SerialCommands* sender) {
+  Stream* s = sender->GetSerial();
+
+  char* action = sender->Next();
+  if (action == nullptr) {
+    printError(s, F("Missing action"));
+    return;
+  }
+  const static char START_STRING[] PROGMEM = "start";
+  const static char STOP_STRING[] PROGMEM = "stop";
+  if (strcmp_P(action, START_STRING) == 0) {
+    if (streaming) {
+      printError(s, F("Stop streaming before tracing"));
+      return;
+    }
+    s->println(F("Starting trace"));
+    // Written by the detect task, so the header holds the state the first
+    // frame builds on
+    traceHeaderPending = true;
+    tracing = true;
+  } else if (strcmp_P(action, STOP_STRING) == 0) {
+    traceHeaderPending = false;
+    tracing = false;
+    s->println(F("Stopped trace"));
+  } else {
+    printError(s, F("Invalid action: "), action);
+  }
+}
+SerialCommand cmdObjTrace("trace", cmdTrace);
+
+void taskSerial();
+void taskDetect();
+void taskScan();
+void taskEEPROM();
+
+const char TASK_SERIAL_NAME[] PROGMEM = "serial";
+const char TASK_DETECT_NAME[] PROGMEM = "detect";
+const char TASK_SCAN_NAME[] PROGMEM = "scan";
+const char TASK_EEPROM_NAME[] PROGMEM = "eeprom";
+
+// In priority order. Serial input is checked every millisecond, running one
+// command per run, and the board is classified and changes reported as soon
+// as a frame has been scanned. Either waits for the longest single run of
+// another task: a scan step or board state save takes a few ms, but a command
+// runs to completion, and commands that scan the board (`crosstalk measure`),
+// write EEPROM (`profile save`, `calibrationSaveToEEPROM`) or print a lot
+// (`print all`) take up to hundreds of ms. The deadlines are what the tasks
+// get when no such command runs, so those commands show up as deadline misses
+// in `tasks`.
+const uint8_t TASK_SERIAL = 0;
+const uint8_t TASK_DETECT = 1;
+const uint8_t TASK_SCAN = 2;
+const uint8_t TASK_EEPROM = 3;
+const uint8_t TASKS_NUM = 4;
+Task tasks[TASKS_NUM] = {
+  // name, run, periodUs, deadlineUs, budgetUs
+  Task(TASK_SERIAL_NAME, taskSerial, 1000, 5000, 1000),
+  Task(TASK_DETECT_NAME, taskDetect, 0, 5000, 5000),
+  Task(TASK_SCAN_NAME, taskScan, LINEAR_HALLS_SETTLE_TIME * 1000, 5000, 2000),
+  Task(TASK_EEPROM_NAME, taskEEPROM, 50000, 50000, 30000),
+};
+SchedulerStats schedulerStats;
+
+// tasks [reset?]
+//   Prints the scheduler overhead and the statistics of every task: how many
+//   times it ran, its average and longest run time, the share of the time it
+//   took and how often it started late or ran over its budget.
+//
+//   reset: Reset the statistics.
+void cmdTasks(SerialCommands* sender) {
+  Stream* s = sender->GetSerial();
+
+  char* action = sender->Next();
+  const static char RESET_STRING[] PROGMEM = "reset";
+  if (action != nullptr) {
+    if (strcmp_P(action, RESET_STRING) != 0) {
+      printError(s, F("Invalid action: "), action);
+      return;
+    }
+    s->println(F("Resetting task statistics"));
+    schedulerResetStats(tasks, TASKS_NUM, schedulerStats);
+    return;
+  }
+
+  const uint32_t elapsed = millis() - schedulerStats.startTime;
+  s->println(F("Printing task statistics"));
+  s->print(F("Time (ms): "));
+  s->println(elapsed);
+  s->print(F("Scheduler passes: "));
+  s->print(schedulerStats.passes);
+  s->print(F(", idle: "));
+  s->println(schedulerStats.idlePasses);
+  s->print(F("Scheduler overhead (us per task run): "));
+  const uint32_t taskRuns = schedulerStats.passes - schedulerStats.idlePasses;
+  s->println(taskRuns == 0 ? 0.0f
+                           : (schedulerStats.overheadMs * 1000.0f +
+                              schedulerStats.overheadRemainderUs) /
+                               taskRuns);
+  for (const Task& task : tasks) {
+    s->print(reinterpret_cast<const __FlashStringHelper*>(task.name));
+    s->print(F(": runs "));
+    s->print(task.runs);
+    s->print(F(", average (us) "));
+    s->print(task.runs == 0 ? 0.0f
+                            : (task.totalRuntimeMs * 1000.0f +
+                               task.totalRuntimeRemainderUs) /
+                                task.runs);
+    s->print(F(", max (us) "));
+    s->print(task.maxRuntimeUs);
+    s->print(F(", load (%) "));
+    s->print(elapsed == 0 ? 0.0f : task.totalRuntimeMs * 100.0f / elapsed);
+    s->print(F(", deadline misses "));
+    s->print(task.deadlineMisses);
+    s->print(F(", budget overruns "));
+    s->println(task.budgetOverruns);
+  }
+}
+SerialCommand cmdObjTasks("tasks", cmdTasks);
+
+SerialCommand* const COMMANDS[] = {&cmdObjPrint,
+                                   &cmdObjCalibrate,
+                                   &cmdObjCalibrationSaveToEEPROM,
+                                   &cmdObjCalibrationLoadFromEEPROM,
+                                   &cmdObjProfile,
+                                   &cmdObjSettings,
+                                   &cmdObjTrace,
+                                   &cmdObjCrosstalk,
+                                   &cmdObjStream,
+                                   &cmdObjHealth,
+                                   &cmdObjTasks};
+
+// #[id] [command] [args...]
+//   Runs a command tagged with a request ID. (0 - 65535) Every line of the
+//   reply starts with "#[id] " and the reply ends with "#[id] END [status]":
+//     0: OK
+//     1: Error (missing or invalid arguments)
+//     2: Unrecognized command
+//   Tagged commands can be sent back to back without waiting for replies, they
+//   are all answered in order as soon as they are read. Keep less than
+//   SERIAL_RX_BUFFER_SIZE bytes of unanswered commands in flight as the
+//   receive buffer must hold them while the board is being scanned. A tag that
+//   isn't a number in range is answered with "[tag] END 1" without running
+//   the command.
+void runTaggedCommand(SerialCommands* sender, const char* tag) {
+  Stream* serial = sender->GetSerial();
+  char* end;
+  const uint32_t parsedId = strtoul(tag + 1, &end, 10);
+  // strtoul also skips spaces and takes signs
+  if (tag[1] < '0' || tag[1] > '9' || *end != '\0' || parsedId > UINT16_MAX) {
+    serial->print(tag);
+    serial->println(F(" Invalid request ID"));
+    serial->print(tag);
+    serial->println(F(" END 1"));
+    return;
+  }
+  const uint16_t id = parsedId;
+  taggedStream.begin(id);
+  sender->AttachSerial(&taggedStream);
+  commandStatus = COMMAND_STATUS_OK;
+
+  const char* name = sender->Next();
+  if (name == nullptr) {
+    printError(&taggedStream, F("Missing command"));
+  } else {
+    SerialCommand* command = nullptr;
+    for (SerialCommand* c : COMMANDS) {
+      if (strcmp(name, c->command) == 0) {
+        command = c;
+        break;
+      }
+    }
+    if (command != nullptr) {
+      command->function(sender);
+    } else {
+      taggedStream.print(F("Unrecognized command: "));
+      taggedStream.println(name);
+      commandStatus = COMMAND_STATUS_UNRECOGNIZED;
+    }
+  }
+
+  sender->AttachSerial(serial);
+  serial->write('#');
+  serial->print(id);
+  serial->print(F(" END "));
+  serial->println(commandStatus);
+}
+
 void cmdUnrecognized(SerialCommands* sender, const char* cmd) {
+  if (cmd[0] == '#') {
+    runTaggedCommand(sender, cmd);
+    return;
+  }
   sender->GetSerial()->print(F("Unrecognized command: "));
   sender->GetSerial()->println(cmd);
 }
 
+void taskSerial() {
+  serialInput.nextLine();
+  if (serialCommands.ReadSerial() == SERIAL_COMMANDS_ERROR_BUFFER_FULL) {
+    Serial.print(F("Command too long, limit is "));
+    Serial.print(sizeof(serialCommandsBuffer) - 1);
+    Serial.println(F(" characters"));
+  }
+}
+
+void taskScan() {
+  if (linearHallsScanStep()) {
+    schedulerTrigger(tasks[TASK_DETECT]);
+  }
+}
+
+void taskDetect() {
+  if (linearHallsFirstFrame) {
+    // Nothing was scanned before, so the first frame isn't a change for the
+    // sensor health, the same as replaying a trace
+    memcpy(linearHallPreviousValues, linearHallValues,
+           sizeof(linearHallValues));
+    linearHallsFirstFrame = false;
+  }
+  if (traceHeaderPending) {
+    // Straight to the serial port as a tagged reply would corrupt the header
+    traceWriteHeader(&Serial);
+    traceHeaderPending = false;
+  }
+  unhealthySquares = healthUpdate(
+    linearHallValues, linearHallPreviousValues, linearHallPresentValues,
+    linearHallEmptyValues, linearHallPresentMargins, linearHallEmptyMargins,
+    linearHallHealth);
+  if (tracing) {
+    traceWriteFrame(&Serial, millis());
+  }
+  if (streaming) {
+    streamWriteFrame(&Serial);
+  }
+  const bool boardChanged = linearHallsUpdatePieces();
+  if (boardChanged) {
+    piecesChangedTime = millis();
+  }
+  bool reportChange = boardChanged;
+  if (!boardStateConfirmed) {
+    // Only report the restored board state if it turned out to be wrong
+    reportChange = !boardChanged && pieces != savedPieces;
+    if (!boardChanged) {
+      boardStateConfirmed = true;
+      boardStateConfirmedTime = millis();
+    }
+  }
+  if (printOnBoardChange && reportChange && !tracing) {
+    Serial.println(F("Board changed:"));
+    printBitboard(&Serial, pieces);
+  }
+}
+
+void taskEEPROM() {
+  saveBoardState();
+}
+
 void setup() {
   Serial.begin(115200);
   pinMode(LED_BUILTIN, OUTPUT);
   digitalWrite(LED_BUILTIN, LOW);
-  Serial.println(F("Chessboard controller starting"));
-
-  delay(500);
-
-  Serial.println(F("Loading settings from EEPROM"));
   loadSettings();
-
-  Serial.println(F("Initializing linear hall sensors"));
+  if (!fastBoot) {
+    Serial.println(F("Chessboard controller starting"));
+    delay(500);
+    Serial.println(F("Loaded settings from EEPROM"));
+    Serial.println(F("Initializing linear hall sensors"));
+  }
   linearHallsBegin();
 
   if (autoLoadCalibration) {
-    Serial.println(F("Loading calibration from EEPROM"));
-    uint16_t bytesRead = 0;
-    Serial.println(F("Loading all arrays from EEPROM"));
-    Serial.println(F("(1/4) Loading present calibration values from EEPROM"));
-    bytesRead += loadArrayFromEEPROM(linearHallPresentValues,
-                                     PRESENT_CALIBRATION_EEPROM_START_ADDR);
-    Serial.println(F("(2/4) Loading empty calibration values from EEPROM"));
-    bytesRead += loadArrayFromEEPROM(linearHallEmptyValues,
-                                     EMPTY_CALIBRATION_EEPROM_START_ADDR);
-    Serial.println(
-      F("(3/4) Loading present calibration margin values from EEPROM"));
-    bytesRead += loadArrayFromEEPROM(
-      linearHallPresentMargins, PRESENT_CALIBRATION_MARGIN_EEPROM_START_ADDR);
-    Serial.println(
-      F("(4/4) Loading empty calibration margin values from EEPROM"));
-    bytesRead += loadArrayFromEEPROM(
-      linearHallEmptyMargins, EMPTY_CALIBRATION_MARGIN_EEPROM_START_ADDR);
-    Serial.print(F("Bytes read: "));
-    Serial.println(bytesRead);
-  } else {
+    if (!fastBoot) {
+      Serial.println(F("Loading calibration from EEPROM"));
+      if (activeProfile != 0 && profileSaved(activeProfile)) {
+        Serial.print(F("Loading calibration profile "));
+        Serial.println(activeProfile);
+      }
+    }
+    const uint16_t bytesRead = loadCalibrationFromEEPROM();
+    if (!fastBoot) {
+      Serial.print(F("Bytes read: "));
+      Serial.println(bytesRead);
+    }
+  } else if (!fastBoot) {
     Serial.println(F("Loading calibration from EEPROM on startup is disabled"));
   }
 
-  Serial.println(F("Initializing command parser"));
-  serialCommands.AddCommand(&cmdObjPrint);
-  serialCommands.AddCommand(&cmdObjCalibrate);
-  serialCommands.AddCommand(&cmdObjCalibrationSaveToEEPROM);
-  serialCommands.AddCommand(&cmdObjCalibrationLoadFromEEPROM);
-  serialCommands.AddCommand(&cmdObjSettings);
+  if (fastBoot && loadBoardState()) {
+    previousPieces = pieces = savedPieces;
+    boardStateRestored = true;
+    boardStateConfirmed = false;
+  }
+
+  if (!fastBoot) {
+    Serial.println(F("Initializing command parser"));
+  }
+  for (SerialCommand* command : COMMANDS) {
+    serialCommands.AddCommand(command);
+  }
   serialCommands.SetDefaultHandler(&cmdUnrecognized);
 
+  linearHallsScanRestart();
+  schedulerBegin(tasks, TASKS_NUM, schedulerStats);
+
+  readyTime = micros();
   Serial.println(F("Ready"));
 }
 
 void loop() {
-  linearHallsRead();
-  const bool boardChanged = linearHallsUpdatePieces();
-  if (printOnBoardChange && boardChanged) {
-    Serial.println(F("Board changed:"));
-    printBitboard(&Serial, pieces);
-  }
-
-  serialCommands.ReadSerial();
+  schedulerRun(tasks, TASKS_NUM, schedulerStats);
 }